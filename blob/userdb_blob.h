@@ -0,0 +1,82 @@
+#ifndef _USERDB_BLOB_H
+#define _USERDB_BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Layout of the name lists the service passes in a sealed memfd instead of inline in the reply, once they are larger
+ * than USERDB_BLOB_THRESHOLD (see the *Fd methods of com.example.UserDb.xml). The client maps the memfd read-only and
+ * reads the names in place:
+ *
+ *   UserDbBlobHeader
+ *   uint32_t offsets[count]     start of each name in the string area
+ *   char strings[stringsSize]   the names, NUL-terminated, in order
+ *
+ * Integers are in native byte order, both ends run on the same host.
+ */
+
+#define USERDB_BLOB_MAGIC 0x42445355u
+#define USERDB_BLOB_VERSION 1
+
+/* Below this size the copies through the socket cost less than creating and mapping a memfd */
+#define USERDB_BLOB_THRESHOLD (64 * 1024)
+
+typedef struct UserDbBlobHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t stringsSize;
+} UserDbBlobHeader;
+
+/* View of a mapped blob */
+typedef struct UserDbBlob
+{
+    const uint32_t *offsets;
+    const char *strings;
+    uint32_t count;
+} UserDbBlob;
+
+static inline size_t userdb_blob_size(uint32_t count, uint32_t stringsSize)
+{
+    return sizeof(UserDbBlobHeader) + (size_t)count * sizeof(uint32_t) + stringsSize;
+}
+
+/* Fills a view of the size bytes at data, which must be 4-byte aligned. Returns -1 if they are not a valid blob. */
+static inline int userdb_blob_open(const void *data, size_t size, UserDbBlob *blob)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    UserDbBlobHeader header;
+
+    if (size < sizeof(header))
+        return -1;
+    memcpy(&header, bytes, sizeof(header));
+    if (header.magic != USERDB_BLOB_MAGIC || header.version != USERDB_BLOB_VERSION)
+        return -1;
+    if ((size - sizeof(header)) / sizeof(uint32_t) < header.count ||
+            userdb_blob_size(header.count, header.stringsSize) != size)
+        return -1;
+
+    blob->offsets = (const uint32_t *)(bytes + sizeof(header));
+    blob->strings = (const char *)(bytes + sizeof(header) + (size_t)header.count * sizeof(uint32_t));
+    blob->count = header.count;
+
+    /* Every name starts inside the string area and the area ends with a NUL, so no name runs past the mapping */
+    if (header.count > 0 && (header.stringsSize == 0 || blob->strings[header.stringsSize - 1] != '\0'))
+        return -1;
+    for (uint32_t i = 0; i < header.count; ++i) {
+        if (blob->offsets[i] >= header.stringsSize)
+            return -1;
+    }
+
+    return 0;
+}
+
+static inline const char *userdb_blob_get(const UserDbBlob *blob, size_t i)
+{
+    return blob->strings + blob->offsets[i];
+}
+
+#endif // _USERDB_BLOB_H
@@ -0,0 +1,15 @@
+find_package(Python3 COMPONENTS Interpreter REQUIRED)
+
+set(GENERATE_MARSHAL_SCRIPT ${CMAKE_CURRENT_LIST_DIR}/generate_marshal.py)
+
+# Generates ${GENERATED_PREFIX}_marshal.h with the (de)serializers of every method of the interface, usable from both
+# C and C++, and a ${GENERATED_PREFIX}-marshal target for the targets including it to depend on
+function(generate_marshal INTROSPECTION_XML GENERATED_DIR GENERATED_PREFIX)
+    set (GENERATED_HEADER "${GENERATED_DIR}/${GENERATED_PREFIX}_marshal.h")
+
+    add_custom_command(OUTPUT ${GENERATED_HEADER}
+        COMMAND ${Python3_EXECUTABLE} ${GENERATE_MARSHAL_SCRIPT} ${INTROSPECTION_XML} ${GENERATED_HEADER} ${GENERATED_PREFIX}
+        DEPENDS ${INTROSPECTION_XML} ${GENERATE_MARSHAL_SCRIPT})
+
+    add_custom_target(${GENERATED_PREFIX}-marshal DEPENDS ${GENERATED_HEADER})
+endfunction()
@@ -0,0 +1,571 @@
+#!/usr/bin/env python3
+"""Generates a header-only marshaller for the methods of a D-Bus introspection XML.
+
+For every method the header has encoders and decoders of its input and output tuples, working directly on the
+serialized GVariant format: the layout of each tuple is computed here, so the generated code reads and writes fields at
+known alignments and never parses a type string at runtime. Decoders return views into the serialized data instead of
+copies. The C part is shared by C and C++ code; C++ code also gets encoders taking any range of strings or integers.
+
+Usage: generate_marshal.py INTROSPECTION_XML OUTPUT_HEADER PREFIX
+"""
+
+import re
+import sys
+import xml.etree.ElementTree as ET
+
+# D-Bus type -> (alignment, fixed size or None if variable-sized)
+TYPES = {
+    "u": (4, 4),
+    "h": (4, 4),
+    "s": (1, None),
+    "as": (1, None),
+    "au": (4, None),
+    "ah": (4, None),
+}
+
+C_SCALARS = {"u": "uint32_t", "h": "int32_t"}
+C_ARRAY32 = {"au": "uint32_t", "ah": "int32_t"}
+
+RUNTIME = r"""
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define @P@_MARSHAL_ALIGN(pos, alignment) (((pos) + (alignment)-1) & ~(size_t)((alignment)-1))
+
+/* View of a serialized array of strings; the strings are NUL-terminated in place */
+typedef struct @T@Strv
+{
+    const uint8_t *data;
+    size_t count;
+    unsigned offsetSize;
+    const uint8_t *offsets;
+} @T@Strv;
+
+/* View of a serialized array of 32-bit integers */
+typedef struct @T@Array32
+{
+    const uint8_t *data;
+    size_t count;
+} @T@Array32;
+
+/* Size of the framing offsets of a container, see the GVariant serialization format */
+static inline unsigned @p@_marshal_offset_size(size_t size)
+{
+    if (size > UINT32_MAX)
+        return 8;
+    if (size > UINT16_MAX)
+        return 4;
+    if (size > UINT8_MAX)
+        return 2;
+    return size > 0 ? 1 : 0;
+}
+
+static inline size_t @p@_marshal_total_size(size_t bodySize, size_t offsets)
+{
+    if (bodySize + offsets <= UINT8_MAX)
+        return bodySize + offsets;
+    if (bodySize + 2 * offsets <= UINT16_MAX)
+        return bodySize + 2 * offsets;
+    if (bodySize + 4 * offsets <= UINT32_MAX)
+        return bodySize + 4 * offsets;
+    return bodySize + 8 * offsets;
+}
+
+static inline size_t @p@_marshal_read_offset(const uint8_t *data, unsigned offsetSize)
+{
+    size_t value = 0;
+    for (unsigned i = 0; i < offsetSize; ++i)
+        value |= (size_t)data[i] << (8 * i);
+    return value;
+}
+
+static inline void @p@_marshal_write_offset(uint8_t *data, size_t value, unsigned offsetSize)
+{
+    for (unsigned i = 0; i < offsetSize; ++i)
+        data[i] = (uint8_t)(value >> (8 * i));
+}
+
+static inline int @p@_marshal_get_string(const uint8_t *data, size_t start, size_t end, const char **value)
+{
+    if (end <= start || data[end - 1] != '\0' || memchr(data + start, '\0', end - start - 1))
+        return -1;
+    *value = (const char *)data + start;
+    return 0;
+}
+
+static inline int @p@_marshal_get_strv(const uint8_t *data, size_t size, @T@Strv *value)
+{
+    memset(value, 0, sizeof(*value));
+    if (size == 0)
+        return 0;
+
+    unsigned offsetSize = @p@_marshal_offset_size(size);
+    size_t offsetsStart = @p@_marshal_read_offset(data + size - offsetSize, offsetSize);
+    if (offsetsStart > size || (size - offsetsStart) % offsetSize != 0)
+        return -1;
+
+    value->data = data;
+    value->count = (size - offsetsStart) / offsetSize;
+    value->offsetSize = offsetSize;
+    value->offsets = data + offsetsStart;
+
+    size_t start = 0;
+    for (size_t i = 0; i < value->count; ++i) {
+        size_t end = @p@_marshal_read_offset(value->offsets + i * offsetSize, offsetSize);
+        const char *unused;
+        if (end > offsetsStart || @p@_marshal_get_string(data, start, end, &unused) < 0)
+            return -1;
+        start = end;
+    }
+    return 0;
+}
+
+static inline const char *@p@_strv_get(const @T@Strv *value, size_t i)
+{
+    size_t start = i > 0 ? @p@_marshal_read_offset(value->offsets + (i - 1) * value->offsetSize, value->offsetSize) : 0;
+    return (const char *)value->data + start;
+}
+
+static inline int @p@_marshal_get_array32(const uint8_t *data, size_t size, @T@Array32 *value)
+{
+    if (size % 4 != 0)
+        return -1;
+    value->data = data;
+    value->count = size / 4;
+    return 0;
+}
+
+static inline uint32_t @p@_array32_get_u32(const @T@Array32 *value, size_t i)
+{
+    uint32_t item;
+    memcpy(&item, value->data + 4 * i, 4);
+    return item;
+}
+
+static inline int32_t @p@_array32_get_i32(const @T@Array32 *value, size_t i)
+{
+    int32_t item;
+    memcpy(&item, value->data + 4 * i, 4);
+    return item;
+}
+
+static inline size_t @p@_marshal_strv_size(const char *const *items, size_t count)
+{
+    size_t bodySize = 0;
+    for (size_t i = 0; i < count; ++i)
+        bodySize += strlen(items[i]) + 1;
+    return @p@_marshal_total_size(bodySize, count);
+}
+
+static inline void @p@_marshal_put_strv(uint8_t *data, size_t size, const char *const *items, size_t count)
+{
+    unsigned offsetSize = @p@_marshal_offset_size(size);
+    uint8_t *offsets = data + size - count * offsetSize;
+    size_t pos = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t length = strlen(items[i]) + 1;
+        memcpy(data + pos, items[i], length);
+        pos += length;
+        @p@_marshal_write_offset(offsets + i * offsetSize, pos, offsetSize);
+    }
+}
+"""
+
+CXX_RUNTIME = r"""
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+namespace @p@ {
+namespace marshal {
+namespace detail {
+
+template <typename T>
+inline auto view(const T &value, int) -> decltype(std::string_view(value.data(), value.bytes()))
+{
+    // Glib::ustring counts characters in size(), bytes() is the byte length
+    return std::string_view(value.data(), value.bytes());
+}
+
+template <typename T>
+inline std::string_view view(const T &value, long)
+{
+    return std::string_view(value);
+}
+
+template <typename T>
+inline std::string_view view(const T &value)
+{
+    return view(value, 0);
+}
+
+template <typename Strings>
+inline std::size_t strvSize(const Strings &items)
+{
+    std::size_t bodySize = 0;
+    std::size_t count = 0;
+    for (const auto &item : items) {
+        bodySize += view(item).size() + 1;
+        ++count;
+    }
+    return @p@_marshal_total_size(bodySize, count);
+}
+
+template <typename Strings>
+inline void putStrv(uint8_t *data, std::size_t size, const Strings &items)
+{
+    unsigned offsetSize = @p@_marshal_offset_size(size);
+    std::size_t count = 0;
+    for (const auto &item : items) {
+        (void)item;
+        ++count;
+    }
+
+    uint8_t *offsets = data + size - count * offsetSize;
+    std::size_t pos = 0;
+    std::size_t i = 0;
+    for (const auto &item : items) {
+        auto s = view(item);
+        std::memcpy(data + pos, s.data(), s.size());
+        pos += s.size();
+        data[pos++] = '\0';
+        @p@_marshal_write_offset(offsets + i++ * offsetSize, pos, offsetSize);
+    }
+}
+
+template <typename Integers>
+inline std::size_t array32Size(const Integers &items)
+{
+    std::size_t count = 0;
+    for (const auto &item : items) {
+        (void)item;
+        ++count;
+    }
+    return 4 * count;
+}
+
+template <typename Value, typename Integers>
+inline void putArray32(uint8_t *data, const Integers &items)
+{
+    for (const auto &item : items) {
+        Value value = static_cast<Value>(item);
+        std::memcpy(data, &value, 4);
+        data += 4;
+    }
+}
+
+} // namespace detail
+"""
+
+
+def upper_first(name):
+    return name[:1].upper() + name[1:]
+
+
+def camel_to_macro(name):
+    return re.sub(r"(?<=[a-z0-9])(?=[A-Z])", "_", name).upper()
+
+
+def load_methods(path):
+    methods = []
+    root = ET.parse(path).getroot()
+    for method in root.iter("method"):
+        args = {"in": [], "out": []}
+        for arg in method.findall("arg"):
+            dbus_type = arg.get("type")
+            if dbus_type not in TYPES:
+                sys.exit("%s: unsupported type '%s' in method %s" % (path, dbus_type, method.get("name")))
+            args[arg.get("direction", "in")].append((arg.get("name"), dbus_type))
+        methods.append((method.get("name"), args))
+    return methods
+
+
+class Layout:
+    """Static layout of a tuple in the GVariant serialization format"""
+
+    def __init__(self, args):
+        self.args = args
+        self.alignment = max([TYPES[t][0] for _, t in args] + [1])
+        self.fixed = all(TYPES[t][1] is not None for _, t in args)
+        # Variable-sized members other than the last one end at a framing offset
+        self.framed = [i for i, (_, t) in enumerate(args) if TYPES[t][1] is None and i != len(args) - 1]
+        if self.fixed:
+            size = 0
+            for _, t in args:
+                size = (size + TYPES[t][0] - 1) & ~(TYPES[t][0] - 1)
+                size += TYPES[t][1]
+            self.fixed_size = (size + self.alignment - 1) & ~(self.alignment - 1)
+
+    def signature(self):
+        return "(" + "".join(t for _, t in self.args) + ")"
+
+
+def c_params(args):
+    params = []
+    for name, t in args:
+        if t in C_SCALARS:
+            params.append("%s %s" % (C_SCALARS[t], name))
+        elif t == "s":
+            params.append("const char *%s" % name)
+        elif t == "as":
+            params.append("const char *const *%s, size_t %sCount" % (name, name))
+        else:
+            params.append("const %s *%s, size_t %sCount" % (C_ARRAY32[t], name, name))
+    return ", ".join(params)
+
+
+def c_member(t, name, p, T):
+    if t in C_SCALARS:
+        return "%s %s;" % (C_SCALARS[t], name)
+    if t == "s":
+        return "const char *%s;" % name
+    if t == "as":
+        return "%sStrv %s;" % (T, name)
+    return "%sArray32 %s;" % (T, name)
+
+
+def size_of(t, name, p, cxx):
+    """Expression of the serialized size of a variable-sized argument"""
+    if t == "s":
+        return "detail::view(%s).size() + 1" % name if cxx else "strlen(%s) + 1" % name
+    if t == "as":
+        return "detail::strvSize(%s)" % name if cxx else "%s_marshal_strv_size(%s, %sCount)" % (p, name, name)
+    return "detail::array32Size(%s)" % name if cxx else "4 * %sCount" % name
+
+
+def emit_size(layout, p, cxx, indent):
+    out = []
+    out.append(indent + "size_t pos = 0;" if not cxx else indent + "std::size_t pos = 0;")
+    for name, t in layout.args:
+        # Only the lengths of variable-sized values matter
+        if TYPES[t][1] is not None or (t in C_ARRAY32 and not cxx):
+            out.append(indent + "(void)%s;" % name)
+    for name, t in layout.args:
+        alignment, fixed = TYPES[t]
+        if alignment > 1:
+            out.append(indent + "pos = %s_MARSHAL_ALIGN(pos, %d);" % (p.upper(), alignment))
+        if fixed is not None:
+            out.append(indent + "pos += %d;" % fixed)
+        else:
+            out.append(indent + "pos += %s;" % size_of(t, name, p, cxx))
+    if layout.fixed:
+        out.append(indent + "(void)pos;")
+        out.append(indent + "return %d;" % layout.fixed_size)
+    else:
+        out.append(indent + "return %s_marshal_total_size(pos, %d);" % (p, len(layout.framed)))
+    return out
+
+
+def emit_encode(layout, p, cxx, indent):
+    out = []
+    size_t = "std::size_t" if cxx else "size_t"
+    out.append(indent + "uint8_t *bytes = (uint8_t *)data;")
+    out.append(indent + "%s pos = 0;" % size_t)
+    if layout.framed:
+        out.append(indent + "unsigned offsetSize = %s_marshal_offset_size(size);" % p)
+    out.append(indent + "memset(bytes, 0, size);")
+    framed_index = 0
+    for i, (name, t) in enumerate(layout.args):
+        alignment, fixed = TYPES[t]
+        if alignment > 1:
+            out.append(indent + "pos = %s_MARSHAL_ALIGN(pos, %d);" % (p.upper(), alignment))
+        if fixed is not None:
+            out.append(indent + "memcpy(bytes + pos, &%s, %d);" % (name, fixed))
+            out.append(indent + "pos += %d;" % fixed)
+        elif t == "s":
+            if cxx:
+                out.append(indent + "std::string_view %sView = detail::view(%s);" % (name, name))
+                out.append(indent + "memcpy(bytes + pos, %sView.data(), %sView.size());" % (name, name))
+                out.append(indent + "pos += %sView.size() + 1;" % name)
+            else:
+                out.append(indent + "memcpy(bytes + pos, %s, strlen(%s) + 1);" % (name, name))
+                out.append(indent + "pos += strlen(%s) + 1;" % name)
+        else:
+            out.append(indent + "{")
+            out.append(indent + "    %s %sSize = %s;" % (size_t, name, size_of(t, name, p, cxx)))
+            if t == "as":
+                if cxx:
+                    out.append(indent + "    detail::putStrv(bytes + pos, %sSize, %s);" % (name, name))
+                else:
+                    out.append(indent + "    %s_marshal_put_strv(bytes + pos, %sSize, %s, %sCount);"
+                               % (p, name, name, name))
+            else:
+                if cxx:
+                    out.append(indent + "    detail::putArray32<%s>(bytes + pos, %s);" % (C_ARRAY32[t], name))
+                else:
+                    out.append(indent + "    memcpy(bytes + pos, %s, %sSize);" % (name, name))
+            out.append(indent + "    pos += %sSize;" % name)
+            out.append(indent + "}")
+        if i in layout.framed:
+            framed_index += 1
+            out.append(indent + "%s_marshal_write_offset(bytes + size - %d * offsetSize, pos, offsetSize);"
+                       % (p, framed_index))
+    out.append(indent + "(void)pos;")
+    return out
+
+
+def emit_decode(layout, p, indent):
+    out = []
+    out.append(indent + "const uint8_t *bytes = (const uint8_t *)data;")
+    out.append(indent + "size_t pos = 0;")
+    if layout.fixed:
+        out.append(indent + "if (size != %d)" % layout.fixed_size)
+        out.append(indent + "    return -1;")
+    elif layout.framed:
+        out.append(indent + "unsigned offsetSize = %s_marshal_offset_size(size);" % p)
+        out.append(indent + "if (size < %d * (size_t)offsetSize)" % len(layout.framed))
+        out.append(indent + "    return -1;")
+        out.append(indent + "size_t framing = size - %d * (size_t)offsetSize;" % len(layout.framed))
+    else:
+        out.append(indent + "size_t framing = size;")
+    framed_index = 0
+    for i, (name, t) in enumerate(layout.args):
+        alignment, fixed = TYPES[t]
+        if alignment > 1:
+            out.append(indent + "pos = %s_MARSHAL_ALIGN(pos, %d);" % (p.upper(), alignment))
+        if fixed is not None:
+            if not layout.fixed:
+                out.append(indent + "if (pos + %d > framing)" % fixed)
+                out.append(indent + "    return -1;")
+            out.append(indent + "memcpy(&out->%s, bytes + pos, %d);" % (name, fixed))
+            out.append(indent + "pos += %d;" % fixed)
+            continue
+
+        out.append(indent + "{")
+        if i in layout.framed:
+            framed_index += 1
+            out.append(indent + "    size_t end = %s_marshal_read_offset(bytes + size - %d * offsetSize, offsetSize);"
+                       % (p, framed_index))
+        else:
+            out.append(indent + "    size_t end = framing;")
+        out.append(indent + "    if (pos > end || end > framing)")
+        out.append(indent + "        return -1;")
+        if t == "s":
+            call = "%s_marshal_get_string(bytes, pos, end, &out->%s)" % (p, name)
+        elif t == "as":
+            call = "%s_marshal_get_strv(bytes + pos, end - pos, &out->%s)" % (p, name)
+        else:
+            call = "%s_marshal_get_array32(bytes + pos, end - pos, &out->%s)" % (p, name)
+        out.append(indent + "    if (%s < 0)" % call)
+        out.append(indent + "        return -1;")
+        out.append(indent + "    pos = end;")
+        out.append(indent + "}")
+    out.append(indent + "(void)pos;")
+    out.append(indent + "return 0;")
+    return out
+
+
+def generate(methods, prefix, interface_name, source):
+    p = prefix.lower()
+    T = interface_name
+    guard = "_%s_MARSHAL_H" % prefix.upper()
+    out = []
+    out.append("/* Generated by generate_marshal.py from %s, do not edit */" % source)
+    out.append("")
+    out.append("#ifndef %s" % guard)
+    out.append("#define %s" % guard)
+    out.append(RUNTIME.replace("@p@", p).replace("@P@", p.upper()).replace("@T@", T))
+
+    for method, args in methods:
+        for direction in ("in", "out"):
+            if not args[direction]:
+                continue
+            layout = Layout(args[direction])
+            macro = "%s_%s_%s_TYPE" % (p.upper(), camel_to_macro(method), direction.upper())
+            struct = "%s%s%s" % (T, method, direction.capitalize())
+            fn = "%s_%s_%s" % (p, method, direction)
+
+            out.append("/* %s %s arguments */" % (method, direction))
+            out.append("")
+            out.append('#define %s "%s"' % (macro, layout.signature()))
+            out.append("")
+            out.append("typedef struct %s" % struct)
+            out.append("{")
+            for name, t in layout.args:
+                out.append("    " + c_member(t, name, p, T))
+            out.append("} %s;" % struct)
+            out.append("")
+            out.append("/* Fills a view of the serialized tuple, returns -1 if it is malformed */")
+            out.append("static inline int %s_decode(const void *data, size_t size, %s *out)" % (fn, struct))
+            out.append("{")
+            out.extend(emit_decode(layout, p, "    "))
+            out.append("}")
+            out.append("")
+            out.append("static inline size_t %s_size(%s)" % (fn, c_params(layout.args)))
+            out.append("{")
+            out.extend(emit_size(layout, p, False, "    "))
+            out.append("}")
+            out.append("")
+            out.append("/* Serializes the tuple into data, which must be %s_size() bytes and 8-byte aligned */" % fn)
+            out.append("static inline void %s_encode(void *data, size_t size, %s)" % (fn, c_params(layout.args)))
+            out.append("{")
+            out.extend(emit_encode(layout, p, False, "    "))
+            out.append("}")
+            out.append("")
+
+    out.append(CXX_RUNTIME.replace("@p@", p).replace("@P@", p.upper()).replace("@T@", T))
+    for method, args in methods:
+        out.append("struct %s" % method)
+        out.append("{")
+        for direction in ("in", "out"):
+            if not args[direction]:
+                continue
+            layout = Layout(args[direction])
+            template = ""
+            if any(TYPES[t][1] is None for _, t in layout.args):
+                names = ["%sT" % upper_first(name) for name, t in layout.args if t in ("s", "as", "au", "ah")]
+                template = "    template <%s>\n" % ", ".join("typename " + n for n in names)
+            params = []
+            for name, t in layout.args:
+                if t in C_SCALARS:
+                    params.append("%s %s" % (C_SCALARS[t], name))
+                else:
+                    params.append("const %sT &%s" % (upper_first(name), name))
+            params = ", ".join(params)
+
+            out.append('    static constexpr const char *%sType = "%s";' % (direction, layout.signature()))
+            out.append("")
+            out.append(template + "    static std::size_t %sSize(%s)" % (direction, params))
+            out.append("    {")
+            out.extend(emit_size(layout, p, True, "        "))
+            out.append("    }")
+            out.append("")
+            out.append(template + "    static void %sEncode(void *data, std::size_t size, %s)" % (direction, params))
+            out.append("    {")
+            out.extend(emit_encode(layout, p, True, "        "))
+            out.append("    }")
+            out.append("")
+        if out[-1] == "":
+            out.pop()
+        out.append("};")
+        out.append("")
+
+    out.append("} // namespace marshal")
+    out.append("} // namespace %s" % p)
+    out.append("#endif // __cplusplus")
+    out.append("")
+    out.append("#endif // %s" % guard)
+    out.append("")
+    return "\n".join(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+
+    source, output, prefix = sys.argv[1:]
+    interface = ET.parse(source).getroot().find("interface")
+    interface_name = interface.get("name").split(".")[-1]
+
+    header = generate(load_methods(source), prefix, interface_name, source.split("/")[-1])
+    with open(output, "w") as f:
+        f.write(header)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,353 @@
+#include <nss.h>
+
+#include <grp.h>
+#include <pwd.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helpers.h"
+
+/*
+ * Contention benchmark for the plugin entry points.
+ *
+ * Every worker thread calls the _nss_example_* functions in a closed loop, the way glibc does on behalf of a heavily
+ * threaded program, for a fixed time. The run is repeated with 1, 2, 4, ... threads up to the maximum, and the
+ * throughput of each step is compared with the single-threaded one: an efficiency well below 100% points to shared
+ * state serializing the threads.
+ *
+ * Lookups of groups and memberships are mostly answered by the per-thread cache pre-warmed by getpwnam, so each step
+ * is run twice: as is, and with the cache of the thread cleared before every call, which measures the round trips
+ * to the service.
+ */
+
+#define BUFFER_SIZE (64 * 1024)
+#define MAX_KEYS 64
+
+enum nss_status _nss_example_getpwnam_r(
+        const char *name, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+enum nss_status _nss_example_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop);
+enum nss_status _nss_example_getgrnam_r(
+        const char *name, struct group *result, char *buffer, size_t buflen, int *errnop);
+enum nss_status _nss_example_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop);
+enum nss_status _nss_example_initgroups_dyn(const char *user, gid_t group, long int *start, long int *size,
+        gid_t **groupsp, long int limit, int *errnop);
+/* From the client cache of the plugin, see userdb-client/cache.h */
+void cache_clear(void);
+
+typedef enum OpType
+{
+    OP_GETPWNAM,
+    OP_GETPWUID,
+    OP_GETGRNAM,
+    OP_GETGRGID,
+    OP_INITGROUPS,
+    OP_COUNT
+} OpType;
+
+static const char *const opNames[OP_COUNT] = {
+        "getpwnam",
+        "getpwuid",
+        "getgrnam",
+        "getgrgid",
+        "initgroups",
+};
+
+typedef struct Worker
+{
+    pthread_t thread;
+    unsigned index;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t busyNs;
+} Worker;
+
+static struct
+{
+    unsigned maxThreads;
+    double duration;
+    bool ops[OP_COUNT];
+    const char *users[MAX_KEYS];
+    uid_t uids[MAX_KEYS];
+    gid_t userGids[MAX_KEYS];
+    size_t userCount;
+    const char *groups[MAX_KEYS];
+    gid_t gids[MAX_KEYS];
+    size_t groupCount;
+} config = {
+        .maxThreads = 64,
+        .duration = 2.0,
+        .ops = {true, true, true, true, true},
+};
+
+static pthread_barrier_t startBarrier;
+static bool stop;
+static bool uncached;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool run_op(OpType op, size_t key, char *buffer)
+{
+    int err = 0;
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    switch (op) {
+        case OP_GETPWNAM: {
+            struct passwd pwd;
+            status = _nss_example_getpwnam_r(config.users[key], &pwd, buffer, BUFFER_SIZE, &err);
+            break;
+        }
+        case OP_GETPWUID: {
+            struct passwd pwd;
+            status = _nss_example_getpwuid_r(config.uids[key], &pwd, buffer, BUFFER_SIZE, &err);
+            break;
+        }
+        case OP_GETGRNAM: {
+            struct group grp;
+            status = _nss_example_getgrnam_r(config.groups[key], &grp, buffer, BUFFER_SIZE, &err);
+            break;
+        }
+        case OP_GETGRGID: {
+            struct group grp;
+            status = _nss_example_getgrgid_r(config.gids[key], &grp, buffer, BUFFER_SIZE, &err);
+            break;
+        }
+        case OP_INITGROUPS: {
+            long int start = 0, size = 0;
+            gid_t *groups = NULL;
+            status = _nss_example_initgroups_dyn(
+                    config.users[key], config.userGids[key], &start, &size, &groups, 0, &err);
+            free(groups);
+            break;
+        }
+        default:
+            break;
+    }
+
+    return status == NSS_STATUS_SUCCESS;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    char *buffer = malloc(BUFFER_SIZE);
+    unsigned next = worker->index;
+
+    pthread_barrier_wait(&startBarrier);
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        OpType op = next % OP_COUNT;
+        size_t key = next / OP_COUNT;
+        ++next;
+
+        if (!config.ops[op])
+            continue;
+
+        bool userOp = op == OP_GETPWNAM || op == OP_GETPWUID || op == OP_INITGROUPS;
+        size_t count = userOp ? config.userCount : config.groupCount;
+        if (count == 0)
+            continue;
+
+        if (uncached)
+            cache_clear();
+
+        uint64_t start = now_ns();
+        bool ok = run_op(op, key % count, buffer);
+        worker->busyNs += now_ns() - start;
+        worker->ops++;
+        if (!ok)
+            worker->errors++;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Runs one step with the given number of threads, with or without the client cache. Returns the throughput in
+ * operations per second.
+ */
+static double run_step(unsigned threads, bool withoutCache, double *meanUs, uint64_t *errors)
+{
+    Worker *workers = calloc(threads, sizeof(Worker));
+
+    uncached = withoutCache;
+    __atomic_store_n(&stop, false, __ATOMIC_RELAXED);
+    pthread_barrier_init(&startBarrier, NULL, threads + 1);
+
+    for (unsigned i = 0; i < threads; ++i) {
+        workers[i].index = i;
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    pthread_barrier_wait(&startBarrier);
+    uint64_t start = now_ns();
+    usleep((useconds_t)(config.duration * 1e6));
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+    uint64_t ops = 0, busyNs = 0;
+    *errors = 0;
+    for (unsigned i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        busyNs += workers[i].busyNs;
+        *errors += workers[i].errors;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    pthread_barrier_destroy(&startBarrier);
+    free(workers);
+
+    *meanUs = ops ? busyNs / 1e3 / ops : 0;
+    return ops / elapsed;
+}
+
+/* Resolves the ids of the configured names once, so that lookups by id hit existing entries */
+static void resolve_keys(void)
+{
+    char *buffer = malloc(BUFFER_SIZE);
+    int err = 0;
+
+    for (size_t i = 0; i < config.userCount; ++i) {
+        struct passwd pwd;
+        if (_nss_example_getpwnam_r(config.users[i], &pwd, buffer, BUFFER_SIZE, &err) == NSS_STATUS_SUCCESS) {
+            config.uids[i] = pwd.pw_uid;
+            config.userGids[i] = pwd.pw_gid;
+        }
+        else {
+            fprintf(stderr, "Unknown user %s, lookups by id will fail\n", config.users[i]);
+        }
+    }
+
+    for (size_t i = 0; i < config.groupCount; ++i) {
+        struct group grp;
+        if (_nss_example_getgrnam_r(config.groups[i], &grp, buffer, BUFFER_SIZE, &err) == NSS_STATUS_SUCCESS)
+            config.gids[i] = grp.gr_gid;
+        else
+            fprintf(stderr, "Unknown group %s, lookups by id will fail\n", config.groups[i]);
+    }
+
+    free(buffer);
+}
+
+static size_t split_list(char *list, const char **items)
+{
+    size_t count = 0;
+    for (char *item = strtok(list, ","); item && count < MAX_KEYS; item = strtok(NULL, ","))
+        items[count++] = item;
+    return count;
+}
+
+static int parse_ops(char *list)
+{
+    const char *names[OP_COUNT * 2];
+    size_t count = 0;
+
+    for (char *item = strtok(list, ","); item && count < countof(names); item = strtok(NULL, ","))
+        names[count++] = item;
+
+    memset(config.ops, 0, sizeof(config.ops));
+    for (size_t i = 0; i < count; ++i) {
+        int op = -1;
+        for (int j = 0; j < OP_COUNT; ++j) {
+            if (strcmp(names[i], opNames[j]) == 0)
+                op = j;
+        }
+        if (op < 0)
+            return -1;
+        config.ops[op] = true;
+    }
+    return count > 0 ? 0 : -1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t N            maximum number of threads, stepped through powers of two (default 64)\n"
+            "  -d SECONDS      duration of each step (default 2)\n"
+            "  -o OPS          entry points to call, e.g. getpwnam,getpwuid,getgrnam,getgrgid,initgroups\n"
+            "  -u USERS        comma-separated user names to look up\n"
+            "  -g GROUPS       comma-separated group names to look up\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    char defaultUsers[] = "com_example_dynamicuser,com_example_dynamicuser2";
+    char defaultGroups[] = "service-client,com_example_dynamicuser";
+    int opt;
+
+    config.userCount = split_list(defaultUsers, config.users);
+    config.groupCount = split_list(defaultGroups, config.groups);
+
+    while ((opt = getopt(argc, argv, "t:d:o:u:g:h")) != -1) {
+        switch (opt) {
+            case 't':
+                config.maxThreads = (unsigned)atoi(optarg);
+                break;
+            case 'd':
+                config.duration = atof(optarg);
+                break;
+            case 'o':
+                if (parse_ops(optarg) < 0) {
+                    fprintf(stderr, "Invalid operations: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                config.userCount = split_list(optarg, config.users);
+                break;
+            case 'g':
+                config.groupCount = split_list(optarg, config.groups);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (config.maxThreads == 0 || config.duration <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    resolve_keys();
+
+    printf("%8s %9s %12s %8s %10s %10s %8s\n", "threads", "cache", "ops/s", "speedup", "efficiency", "mean-us",
+            "errors");
+
+    /* Speedups are relative to the single-threaded run with the same cache setting */
+    double baseline[2] = {0, 0};
+    for (unsigned threads = 1;; threads = threads * 2 < config.maxThreads ? threads * 2 : config.maxThreads) {
+        for (int withoutCache = 0; withoutCache < 2; ++withoutCache) {
+            double meanUs;
+            uint64_t errors;
+            double throughput = run_step(threads, withoutCache, &meanUs, &errors);
+            if (threads == 1)
+                baseline[withoutCache] = throughput;
+
+            double speedup = baseline[withoutCache] > 0 ? throughput / baseline[withoutCache] : 0;
+            printf("%8u %9s %12.0f %8.2f %9.0f%% %10.1f %8llu\n", threads, withoutCache ? "uncached" : "cached",
+                    throughput, speedup, 100.0 * speedup / threads, meanUs, (unsigned long long)errors);
+            fflush(stdout);
+        }
+
+        if (threads == config.maxThreads)
+            break;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -7,12 +7,17 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <cache.h>
 #include <client.h>
 
+#define USERDB_TRACE_SEMAPHORES
+#include <userdb_trace.h>
+
 #include "helpers.h"
 
 typedef struct GetentData
@@ -74,13 +79,14 @@ static char *init_passwd_struct(struct passwd *pwd, char *buffer, size_t buflen,
     return bufPos;
 }
 
-enum nss_status _nss_example_getpwnam_r(
+static enum nss_status getpwnam_r_impl(
         const char *name, struct passwd *result, char *buffer, size_t buflen, int *errnop)
 {
     char *bufPos = init_passwd_struct(result, buffer, buflen, NULL);
     UserEntry userEntry;
 
-    int ret = get_user_by_name(name, &userEntry);
+    /* Fetch the primary and supplementary groups along, getgrgid() and initgroups() usually follow */
+    int ret = get_user_by_name_expanded(name, &userEntry);
 
     if (ret < 0) {
         return NSS_STATUS_NOTFOUND;
@@ -98,7 +104,7 @@ enum nss_status _nss_example_getpwnam_r(
     return NSS_STATUS_SUCCESS;
 }
 
-enum nss_status _nss_example_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop)
+static enum nss_status getpwuid_r_impl(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop)
 {
     char *bufPos = init_passwd_struct(result, buffer, buflen, NULL);
     UserEntry userEntry;
@@ -120,31 +126,64 @@ enum nss_status _nss_example_getpwuid_r(uid_t uid, struct passwd *result, char *
     return NSS_STATUS_SUCCESS;
 }
 
-void copy_group_entry(const GroupEntry *entry, struct group *result, char *buffer, size_t buflen)
+/* Returns -1 if the buffer is too small, the caller then reports ERANGE for glibc to retry with a larger one */
+int copy_group_entry(const GroupEntry *entry, struct group *result, char *buffer, size_t buflen)
 {
     char *bufPos = buffer;
-    int count = 0;
+    char *bufEnd = buffer + buflen;
+    size_t len = strlen(entry->name) + 1;
 
-    count = sprintf(bufPos, "%s", entry->name);
+    if (len > (size_t)(bufEnd - bufPos))
+        return -1;
+    memcpy(bufPos, entry->name, len);
     result->gr_name = bufPos;
-    bufPos += count + 1;
+    bufPos += len;
 
     result->gr_gid = entry->gid;
 
+    /* The member array is aligned for pointers, the names follow it */
+    size_t pad = (sizeof(char *) - (uintptr_t)bufPos % sizeof(char *)) % sizeof(char *);
+    size_t arraySize = sizeof(char *) * (entry->membersCount + 1);
+    if (pad + arraySize > (size_t)(bufEnd - bufPos))
+        return -1;
+    bufPos += pad;
     result->gr_mem = (char **)bufPos;
-    memset(result->gr_mem, 0, sizeof(char *) * (count + 1));
-
-    bufPos += sizeof(char *) * (count + 1);
-    if (entry->membersCount > 0) {
-        for (size_t i = 0; i < entry->membersCount; i++) {
-            count = sprintf(bufPos, "%s", entry->members[i]);
-            result->gr_mem[i] = bufPos;
-            bufPos += count + 1;
-        }
+    bufPos += arraySize;
+
+    /* Large member lists point straight into the memfd the service passed them in, this is their only copy */
+    for (size_t i = 0; i < entry->membersCount; i++) {
+        len = strlen(entry->members[i]) + 1;
+        if (len > (size_t)(bufEnd - bufPos))
+            return -1;
+        memcpy(bufPos, entry->members[i], len);
+        result->gr_mem[i] = bufPos;
+        bufPos += len;
     }
+    result->gr_mem[entry->membersCount] = NULL;
+
+    return 0;
 }
 
-enum nss_status _nss_example_getgrnam_r(
+/*
+ * Fills the result from the entry and frees it. A group that does not fit the buffer is kept in the per-thread cache,
+ * so that the retry glibc makes with a larger buffer does not fetch and decode it from the service again.
+ */
+static enum nss_status return_group_entry(
+        GroupEntry *entry, struct group *result, char *bufPos, size_t buflen, int *errnop)
+{
+    int ret = copy_group_entry(entry, result, bufPos, buflen);
+    if (ret < 0)
+        cache_put_group(entry);
+    free_group_entry(entry);
+
+    if (ret < 0) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status getgrnam_r_impl(
         const char *name, struct group *result, char *buffer, size_t buflen, int *errnop)
 {
     char *bufPos = init_group_struct(result, buffer, buflen, NULL);
@@ -155,12 +194,10 @@ enum nss_status _nss_example_getgrnam_r(
     if (ret < 0)
         return NSS_STATUS_NOTFOUND;
 
-    copy_group_entry(&entry, result, bufPos, buflen);
-    free_group_entry(&entry);
-    return NSS_STATUS_SUCCESS;
+    return return_group_entry(&entry, result, bufPos, buflen - (bufPos - buffer), errnop);
 }
 
-enum nss_status _nss_example_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop)
+static enum nss_status getgrgid_r_impl(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop)
 {
     char *bufPos = init_group_struct(result, buffer, buflen, NULL);
     GroupEntry entry;
@@ -169,12 +206,10 @@ enum nss_status _nss_example_getgrgid_r(gid_t gid, struct group *result, char *b
     if (ret < 0)
         return NSS_STATUS_NOTFOUND;
 
-    copy_group_entry(&entry, result, bufPos, buflen);
-    free_group_entry(&entry);
-    return NSS_STATUS_SUCCESS;
+    return return_group_entry(&entry, result, bufPos, buflen - (bufPos - buffer), errnop);
 }
 
-enum nss_status _nss_example_endgrent(void)
+static enum nss_status endgrent_impl(void)
 {
     __attribute__((cleanup(pthread_mutex_unlock_assertp))) pthread_mutex_t *_l = NULL;
     _l = pthread_mutex_lock_assert(&getgrent_data.mutex);
@@ -184,7 +219,7 @@ enum nss_status _nss_example_endgrent(void)
     return NSS_STATUS_SUCCESS;
 }
 
-enum nss_status _nss_example_setgrent(int stayopen)
+static enum nss_status setgrent_impl(int stayopen)
 {
     __attribute__((cleanup(pthread_mutex_unlock_assertp))) pthread_mutex_t *_l = NULL;
     _l = pthread_mutex_lock_assert(&getgrent_data.mutex);
@@ -199,7 +234,7 @@ enum nss_status _nss_example_setgrent(int stayopen)
     return NSS_STATUS_SUCCESS;
 }
 
-enum nss_status _nss_example_getgrent_r(struct group *result, char *buffer, size_t buflen, int *errnop)
+static enum nss_status getgrent_r_impl(struct group *result, char *buffer, size_t buflen, int *errnop)
 {
     int r;
 
@@ -223,9 +258,127 @@ enum nss_status _nss_example_getgrent_r(struct group *result, char *buffer, size
     if (ret < 0)
         return NSS_STATUS_UNAVAIL;
 
-    copy_group_entry(&entry, result, bufPos, buflen);
-    free_group_entry(&entry);
-    getgrent_data.array_index++;
+    enum nss_status status = return_group_entry(&entry, result, bufPos, buflen - (bufPos - buffer), errnop);
+    if (status == NSS_STATUS_SUCCESS)
+        getgrent_data.array_index++;
 
+    return status;
+}
+
+static enum nss_status initgroups_dyn_impl(const char *user, gid_t group, long int *start, long int *size,
+        gid_t **groupsp, long int limit, int *errnop)
+{
+    gid_t *gids = NULL;
+    size_t count = 0;
+
+    if (get_user_groups(user, &gids, &count) < 0)
+        return NSS_STATUS_NOTFOUND;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (gids[i] == group)
+            continue;
+
+        bool present = false;
+        for (long int j = 0; j < *start && !present; ++j)
+            present = (*groupsp)[j] == gids[i];
+        if (present)
+            continue;
+
+        if (*start == *size) {
+            if (limit > 0 && *size >= limit)
+                break;
+
+            long int newSize = *size > 0 ? 2 * *size : 16;
+            if (limit > 0 && newSize > limit)
+                newSize = limit;
+
+            gid_t *newGroups = realloc(*groupsp, newSize * sizeof(gid_t));
+            if (!newGroups) {
+                free(gids);
+                *errnop = ENOMEM;
+                return NSS_STATUS_TRYAGAIN;
+            }
+            *groupsp = newGroups;
+            *size = newSize;
+        }
+
+        (*groupsp)[(*start)++] = gids[i];
+    }
+
+    free(gids);
     return NSS_STATUS_SUCCESS;
 }
+
+/*
+ * Exported entry points: each lookup gets a request id shared by the plugin and client tracepoints,
+ * see userdb_trace.h. Making the id costs a getpid() and a shared atomic, so it is only done while traced.
+ */
+#define NSS_TRACE_SEMAPHORES(fn)                                                                                       \
+    USERDB_TRACE_SEMAPHORE(nss_example, fn##_entry);                                                                   \
+    USERDB_TRACE_SEMAPHORE(nss_example, fn##_return)
+
+NSS_TRACE_SEMAPHORES(getpwnam);
+NSS_TRACE_SEMAPHORES(getpwuid);
+NSS_TRACE_SEMAPHORES(getgrnam);
+NSS_TRACE_SEMAPHORES(getgrgid);
+NSS_TRACE_SEMAPHORES(endgrent);
+NSS_TRACE_SEMAPHORES(setgrent);
+NSS_TRACE_SEMAPHORES(getgrent);
+NSS_TRACE_SEMAPHORES(initgroups);
+
+#define NSS_TRACED_CALL(fn, key, call)                                                                                 \
+    do {                                                                                                               \
+        bool _traced = USERDB_TRACE_ENABLED(nss_example, fn##_entry) ||                                                \
+                       USERDB_TRACE_ENABLED(nss_example, fn##_return);                                                 \
+        uint64_t _id = _traced ? userdb_trace_begin() : 0;                                                             \
+        (void)_id;                                                                                                     \
+        USERDB_TRACE(nss_example, fn##_entry, _id, key);                                                               \
+        enum nss_status _status = call;                                                                                \
+        USERDB_TRACE(nss_example, fn##_return, _id, _status);                                                          \
+        if (_traced)                                                                                                   \
+            userdb_trace_end();                                                                                        \
+        return _status;                                                                                                \
+    } while (0)
+
+enum nss_status _nss_example_getpwnam_r(
+        const char *name, struct passwd *result, char *buffer, size_t buflen, int *errnop)
+{
+    NSS_TRACED_CALL(getpwnam, name, getpwnam_r_impl(name, result, buffer, buflen, errnop));
+}
+
+enum nss_status _nss_example_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop)
+{
+    NSS_TRACED_CALL(getpwuid, uid, getpwuid_r_impl(uid, result, buffer, buflen, errnop));
+}
+
+enum nss_status _nss_example_getgrnam_r(
+        const char *name, struct group *result, char *buffer, size_t buflen, int *errnop)
+{
+    NSS_TRACED_CALL(getgrnam, name, getgrnam_r_impl(name, result, buffer, buflen, errnop));
+}
+
+enum nss_status _nss_example_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop)
+{
+    NSS_TRACED_CALL(getgrgid, gid, getgrgid_r_impl(gid, result, buffer, buflen, errnop));
+}
+
+enum nss_status _nss_example_endgrent(void)
+{
+    NSS_TRACED_CALL(endgrent, 0, endgrent_impl());
+}
+
+enum nss_status _nss_example_setgrent(int stayopen)
+{
+    NSS_TRACED_CALL(setgrent, stayopen, setgrent_impl(stayopen));
+}
+
+enum nss_status _nss_example_getgrent_r(struct group *result, char *buffer, size_t buflen, int *errnop)
+{
+    NSS_TRACED_CALL(getgrent, 0, getgrent_r_impl(result, buffer, buflen, errnop));
+}
+
+enum nss_status _nss_example_initgroups_dyn(const char *user, gid_t group, long int *start, long int *size,
+        gid_t **groupsp, long int limit, int *errnop)
+{
+    NSS_TRACED_CALL(initgroups, user, initgroups_dyn_impl(user, group, start, size, groupsp, limit, errnop));
+}
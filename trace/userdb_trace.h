@@ -0,0 +1,48 @@
+#ifndef _USERDB_TRACE_H
+#define _USERDB_TRACE_H
+
+/*
+ * Statically defined tracepoints shared by the NSS plugin, the client library and the service.
+ *
+ * With sys/sdt.h available every USERDB_TRACE() compiles to a single nop plus a note in the ELF file, so probes cost
+ * nothing until a tracer attaches to them:
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libnss_example.so.2:nss_example:getgrnam_entry { @start[arg0] = nsecs; }
+ *                usdt:/usr/lib/libnss_example.so.2:nss_example:getgrnam_return { @ns = hist(nsecs - @start[arg0]); }'
+ *
+ * Providers:
+ *   nss_example     <fn>_entry(request_id, key), <fn>_return(request_id, nss_status) for every _nss_example_<fn>
+ *   userdb_client   call_entry(request_id, method), connected(request_id), call_sent(request_id, serial),
+ *                   call_return(request_id, method, status),
+ *                   async_send(serial, method), async_reply(serial, status),
+ *                   cache_hit(kind, id), cache_miss(kind, id)
+ *   userdb_service  method_entry(id, method, peer_pid, serial), method_return(id, method),
+ *                   internal_hit(id, key), cache_hit(id, key), cache_miss(id, key),
+ *                   group_fallback_entry(id, key), group_fallback_return(id, status)
+ *
+ * The request id of the plugin and the client is the same for one lookup. The service runs in another process, so
+ * its probes carry the peer pid and message serial of the call instead, which match the caller's pid and the
+ * serial reported by call_sent and async_send.
+ *
+ * Probes whose arguments are costly to compute are guarded by USERDB_TRACE_ENABLED(), which reads the semaphore the
+ * tracer increments while attached to the probe. A file using it defines USERDB_TRACE_SEMAPHORES before including
+ * this header and declares with USERDB_TRACE_SEMAPHORE() the semaphore of every probe it emits.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#ifdef USERDB_TRACE_SEMAPHORES
+#define _SDT_HAS_SEMAPHORES 1
+#endif
+#include <sys/sdt.h>
+#define USERDB_TRACE(provider, name, ...) STAP_PROBEV(provider, name, ##__VA_ARGS__)
+#define USERDB_TRACE_SEMAPHORE(provider, name)                                                                         \
+    __extension__ volatile unsigned short provider##_##name##_semaphore __attribute__((unused))                       \
+    __attribute__((section(".probes"))) __attribute__((visibility("hidden")))
+#define USERDB_TRACE_ENABLED(provider, name) __builtin_expect(provider##_##name##_semaphore != 0, 0)
+#else
+#define USERDB_TRACE(provider, name, ...) ((void)0)
+#define USERDB_TRACE_SEMAPHORE(provider, name) extern int userdb_trace_no_semaphore_##provider##_##name
+#define USERDB_TRACE_ENABLED(provider, name) 0
+#endif
+
+#endif // _USERDB_TRACE_H
@@ -0,0 +1,225 @@
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <userdb_trace.h>
+
+#define CACHE_SLOTS 32
+#define CACHE_TTL_NS (5 * 1000000000ull)
+
+typedef struct GroupSlot
+{
+    uint64_t expires;
+    GroupEntry entry;
+} GroupSlot;
+
+typedef struct UserGroupsSlot
+{
+    uint64_t expires;
+    char *user;
+    gid_t *gids;
+    size_t count;
+} UserGroupsSlot;
+
+/*
+ * Each thread has a cache of its own: the records pre-warmed by a lookup are asked for by the same thread right after
+ * it, and threads resolving ids concurrently never share a lock or a cache line.
+ */
+typedef struct Cache
+{
+    GroupSlot groups[CACHE_SLOTS];
+    size_t nextGroup;
+    UserGroupsSlot userGroups[CACHE_SLOTS];
+    size_t nextUserGroups;
+} Cache;
+
+static __thread Cache *threadCache;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+static bool cacheKeyCreated;
+
+static void clear_cache(Cache *cache)
+{
+    for (size_t i = 0; i < CACHE_SLOTS; ++i) {
+        free_group_entry(&cache->groups[i].entry);
+        free(cache->userGroups[i].user);
+        free(cache->userGroups[i].gids);
+        cache->userGroups[i].user = NULL;
+        cache->userGroups[i].gids = NULL;
+    }
+}
+
+static void free_cache(void *data)
+{
+    clear_cache(data);
+    free(data);
+}
+
+static void create_cache_key(void)
+{
+    cacheKeyCreated = pthread_key_create(&cacheKey, free_cache) == 0;
+}
+
+/*
+ * The key must not outlive the library: a thread exiting after dlclose() would call free_cache() in unmapped code.
+ * Caches of other threads are leaked, as their thread-local pointers are gone with the library.
+ */
+__attribute__((destructor)) static void delete_cache_key(void)
+{
+    if (!cacheKeyCreated)
+        return;
+
+    if (threadCache) {
+        pthread_setspecific(cacheKey, NULL);
+        free_cache(threadCache);
+        threadCache = NULL;
+    }
+    pthread_key_delete(cacheKey);
+    cacheKeyCreated = false;
+}
+
+/* The cache of the calling thread, freed when the thread exits. NULL if it cannot be allocated. */
+static Cache *get_cache(void)
+{
+    if (threadCache)
+        return threadCache;
+
+    pthread_once(&cacheKeyOnce, create_cache_key);
+    threadCache = calloc(1, sizeof(Cache));
+    if (threadCache)
+        pthread_setspecific(cacheKey, threadCache);
+    return threadCache;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void copy_group(const GroupEntry *src, GroupEntry *dst)
+{
+    dst->name = strdup(src->name);
+    dst->gid = src->gid;
+    dst->membersCount = src->membersCount;
+    dst->members = malloc(sizeof(char *) * (src->membersCount + 1));
+    for (size_t i = 0; i < src->membersCount; ++i)
+        dst->members[i] = strdup(src->members[i]);
+    dst->members[src->membersCount] = NULL;
+    dst->mapping = NULL;
+    dst->mappingSize = 0;
+}
+
+void cache_put_group(const GroupEntry *entry)
+{
+    Cache *cache = get_cache();
+    if (!cache)
+        return;
+
+    GroupSlot *slot = NULL;
+    for (size_t i = 0; i < CACHE_SLOTS && !slot; ++i) {
+        if (cache->groups[i].entry.name && cache->groups[i].entry.gid == entry->gid)
+            slot = &cache->groups[i];
+    }
+    if (!slot)
+        slot = &cache->groups[cache->nextGroup++ % CACHE_SLOTS];
+
+    free_group_entry(&slot->entry);
+    copy_group(entry, &slot->entry);
+    slot->expires = now_ns() + CACHE_TTL_NS;
+}
+
+static int cache_get_group(const char *name, gid_t gid, GroupEntry *pEntry)
+{
+    Cache *cache = threadCache;
+    uint64_t now = now_ns();
+    int ret = -1;
+
+    for (size_t i = 0; i < CACHE_SLOTS && cache; ++i) {
+        const GroupSlot *slot = &cache->groups[i];
+        if (!slot->entry.name || slot->expires < now)
+            continue;
+
+        if (name ? strcmp(slot->entry.name, name) == 0 : slot->entry.gid == gid) {
+            copy_group(&slot->entry, pEntry);
+            ret = 0;
+            break;
+        }
+    }
+
+    if (ret == 0)
+        USERDB_TRACE(userdb_client, cache_hit, "group", (uint32_t)pEntry->gid);
+    else
+        USERDB_TRACE(userdb_client, cache_miss, "group", (uint32_t)gid);
+    return ret;
+}
+
+void cache_clear(void)
+{
+    if (threadCache)
+        clear_cache(threadCache);
+}
+
+int cache_get_group_by_id(gid_t gid, GroupEntry *pEntry)
+{
+    return cache_get_group(NULL, gid, pEntry);
+}
+
+int cache_get_group_by_name(const char *name, GroupEntry *pEntry)
+{
+    return cache_get_group(name, 0, pEntry);
+}
+
+void cache_put_user_groups(const char *user, const gid_t *gids, size_t count)
+{
+    Cache *cache = get_cache();
+    if (!cache)
+        return;
+
+    UserGroupsSlot *slot = NULL;
+    for (size_t i = 0; i < CACHE_SLOTS && !slot; ++i) {
+        if (cache->userGroups[i].user && strcmp(cache->userGroups[i].user, user) == 0)
+            slot = &cache->userGroups[i];
+    }
+    if (!slot)
+        slot = &cache->userGroups[cache->nextUserGroups++ % CACHE_SLOTS];
+
+    free(slot->user);
+    free(slot->gids);
+    slot->user = strdup(user);
+    slot->gids = malloc(sizeof(gid_t) * (count ? count : 1));
+    memcpy(slot->gids, gids, sizeof(gid_t) * count);
+    slot->count = count;
+    slot->expires = now_ns() + CACHE_TTL_NS;
+}
+
+int cache_get_user_groups(const char *user, gid_t **pGids, size_t *pCount)
+{
+    Cache *cache = threadCache;
+    uint64_t now = now_ns();
+    int ret = -1;
+
+    for (size_t i = 0; i < CACHE_SLOTS && cache; ++i) {
+        const UserGroupsSlot *slot = &cache->userGroups[i];
+        if (!slot->user || slot->expires < now || strcmp(slot->user, user) != 0)
+            continue;
+
+        *pGids = malloc(sizeof(gid_t) * (slot->count ? slot->count : 1));
+        memcpy(*pGids, slot->gids, sizeof(gid_t) * slot->count);
+        *pCount = slot->count;
+        ret = 0;
+        break;
+    }
+
+    if (ret == 0)
+        USERDB_TRACE(userdb_client, cache_hit, "user-groups", 0);
+    else
+        USERDB_TRACE(userdb_client, cache_miss, "user-groups", 0);
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef _USERDB_CLIENT_CACHE_H
+#define _USERDB_CLIENT_CACHE_H
+
+#include <stddef.h>
+
+#include "client.h"
+
+/*
+ * Short-lived cache of records that arrived bundled with another reply (see get_user_by_name_expanded()).
+ * It only answers the follow-up lookups of one login, so entries expire after a few seconds and are only visible to
+ * the thread that stored them.
+ */
+
+void cache_put_group(const GroupEntry *entry);
+
+/* Return 0 and fill a copy of the cached record on a hit, -1 on a miss */
+int cache_get_group_by_id(gid_t gid, GroupEntry *pEntry);
+
+int cache_get_group_by_name(const char *name, GroupEntry *pEntry);
+
+void cache_put_user_groups(const char *user, const gid_t *gids, size_t count);
+
+int cache_get_user_groups(const char *user, gid_t **pGids, size_t *pCount);
+
+/* Drop the records cached by the calling thread, e.g. to measure lookups that miss the cache */
+void cache_clear(void);
+
+#endif // _USERDB_CLIENT_CACHE_H
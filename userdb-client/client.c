@@ -1,51 +1,202 @@
-#include "client.h"
+#define _GNU_SOURCE
 
+#include "client.h"
+#include "cache.h"
+#include "client_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 
-#define DEFAULT_USERDB_SERVICE_PATH "unix:path=/tmp/user-db.sock"
+#include <userdb_blob.h>
+
+#define USERDB_TRACE_SEMAPHORES
+#include <userdb_trace.h>
 
-static GVariant *call_dbus(const char *methodName, GVariant *methodArgs)
+USERDB_TRACE_SEMAPHORE(userdb_client, call_entry);
+USERDB_TRACE_SEMAPHORE(userdb_client, connected);
+USERDB_TRACE_SEMAPHORE(userdb_client, call_sent);
+USERDB_TRACE_SEMAPHORE(userdb_client, call_return);
+
+static __thread uint64_t currentRequestId;
+static uint64_t lastRequestId;
+
+uint64_t userdb_trace_begin(void)
 {
-    GDBusConnection *connection = NULL;
-    GDBusProxy *proxy = NULL;
-    GVariant *response = NULL;
-    GError *error = NULL;
+    uint32_t seq = (uint32_t)__atomic_add_fetch(&lastRequestId, 1, __ATOMIC_RELAXED);
+    currentRequestId = ((uint64_t)getpid() << 32) | seq;
+    return currentRequestId;
+}
 
-    char **groups = NULL;
+void userdb_trace_end(void)
+{
+    currentRequestId = 0;
+}
 
-    connection = g_dbus_connection_new_for_address_sync(
-            DEFAULT_USERDB_SERVICE_PATH, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL, &error);
+/*
+ * Connection shared by all threads. Lookups only load the pointer: a published connection is never released while
+ * the library is loaded, so readers neither take a lock nor touch its reference count. When the service goes away the
+ * closed connection is replaced under connectMutex and kept on the retired list.
+ */
+static GDBusConnection *sharedConnection;
+static pthread_mutex_t connectMutex = PTHREAD_MUTEX_INITIALIZER;
+static GSList *retiredConnections;
 
-    if (error) {
-        fprintf(stderr, "Failed to connect to UserDB: %s\n", error->message);
-        g_error_free(error);
-        goto finish0;
+static GDBusConnection *get_connection(GError **error)
+{
+    GDBusConnection *connection = __atomic_load_n(&sharedConnection, __ATOMIC_ACQUIRE);
+    if (connection && !g_dbus_connection_is_closed(connection))
+        return connection;
+
+    pthread_mutex_lock(&connectMutex);
+
+    connection = __atomic_load_n(&sharedConnection, __ATOMIC_RELAXED);
+    if (!connection || g_dbus_connection_is_closed(connection)) {
+        GDBusConnection *fresh = g_dbus_connection_new_for_address_sync(
+                DEFAULT_USERDB_SERVICE_PATH, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL, error);
+        if (fresh) {
+            if (connection)
+                retiredConnections = g_slist_prepend(retiredConnections, connection);
+            __atomic_store_n(&sharedConnection, fresh, __ATOMIC_RELEASE);
+        }
+        connection = fresh;
     }
 
-    proxy = g_dbus_proxy_new_sync(connection, 0, NULL, NULL, "/com/example/UserDb", "com.example.UserDb", NULL, &error);
-    if (error) {
-        fprintf(stderr, "Failed to create proxy: %s\n", error->message);
-        g_error_free(error);
-        goto finish1;
+    pthread_mutex_unlock(&connectMutex);
+    return connection;
+}
+
+/*
+ * A forked child inherits the connection object but not the GDBus worker thread serving it, and shares its socket
+ * with the parent: a call on it would hang or interleave with the parent's messages. The child abandons it without
+ * touching it and connects on its next lookup; the socket is close-on-exec. connectMutex is held across fork() so
+ * that the child never inherits it locked.
+ */
+static void prepare_fork(void)
+{
+    pthread_mutex_lock(&connectMutex);
+}
+
+static void parent_after_fork(void)
+{
+    pthread_mutex_unlock(&connectMutex);
+}
+
+static void child_after_fork(void)
+{
+    sharedConnection = NULL;
+    retiredConnections = NULL;
+    pthread_mutex_unlock(&connectMutex);
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void)
+{
+    pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+}
+
+__attribute__((destructor)) static void release_connections(void)
+{
+    g_slist_free_full(retiredConnections, g_object_unref);
+    if (sharedConnection)
+        g_object_unref(sharedConnection);
+}
+
+/* Sends one method call and waits for the reply body; the serial of the call is reported for tracing */
+static GVariant *send_call(GDBusConnection *connection, const char *methodName, GVariant *methodArgs,
+        uint64_t requestId, GUnixFDList **pFdList, GError **error)
+{
+    GVariant *body = NULL;
+    guint32 serial = 0;
+
+    GDBusMessage *msg = g_dbus_message_new_method_call(NULL, USERDB_OBJECT_PATH, USERDB_INTERFACE_NAME, methodName);
+    if (methodArgs)
+        g_dbus_message_set_body(msg, methodArgs);
+
+    GDBusMessage *reply = g_dbus_connection_send_message_with_reply_sync(
+            connection, msg, G_DBUS_SEND_MESSAGE_FLAGS_NONE, -1, &serial, NULL, error);
+    g_object_unref(msg);
+
+    USERDB_TRACE(userdb_client, call_sent, requestId, serial);
+
+    if (!reply || g_dbus_message_to_gerror(reply, error))
+        goto finish;
+
+    body = g_dbus_message_get_body(reply);
+    if (!body) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Empty reply");
+        goto finish;
     }
+    g_variant_ref(body);
 
-    response = g_dbus_proxy_call_sync(proxy, methodName, methodArgs, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    GUnixFDList *fdList = g_dbus_message_get_unix_fd_list(reply);
+    if (pFdList && fdList)
+        *pFdList = g_object_ref(fdList);
 
-    if (error) {
-        fprintf(stderr, "Failed to issue method call %s: %s\n", methodName, error->message);
-        g_error_free(error);
-        goto finish2;
+finish:
+    if (reply)
+        g_object_unref(reply);
+    return body;
+}
+
+/* pFdList receives the fds passed with the reply, if any; it may be NULL for methods that pass none */
+static GVariant *call_dbus(const char *methodName, GVariant *methodArgs, GUnixFDList **pFdList)
+{
+    GDBusConnection *connection = NULL;
+    GVariant *response = NULL;
+    GError *error = NULL;
+    /* Making a request id costs a getpid() and a shared atomic, so it is only done while traced */
+    bool traced = USERDB_TRACE_ENABLED(userdb_client, call_entry) || USERDB_TRACE_ENABLED(userdb_client, connected) ||
+                  USERDB_TRACE_ENABLED(userdb_client, call_sent) || USERDB_TRACE_ENABLED(userdb_client, call_return);
+    bool ownRequestId = currentRequestId == 0 && traced;
+    uint64_t requestId = ownRequestId ? userdb_trace_begin() : currentRequestId;
+
+    USERDB_TRACE(userdb_client, call_entry, requestId, methodName);
+
+    /* Kept across a retry */
+    if (methodArgs)
+        g_variant_ref_sink(methodArgs);
+
+    /* A connection closed by the service, e.g. by an instance replaced through a hot restart, is retried once */
+    for (int attempt = 0; attempt < 2 && !response; ++attempt) {
+        connection = get_connection(&error);
+
+        if (error) {
+            fprintf(stderr, "Failed to connect to UserDB: %s\n", error->message);
+            g_error_free(error);
+            goto finish;
+        }
+
+        USERDB_TRACE(userdb_client, connected, requestId);
+
+        response = send_call(connection, methodName, methodArgs, requestId, pFdList, &error);
+
+        if (error) {
+            if (attempt == 0 && g_dbus_connection_is_closed(connection)) {
+                g_clear_error(&error);
+                continue;
+            }
+            fprintf(stderr, "Failed to issue method call %s: %s\n", methodName, error->message);
+            g_error_free(error);
+            break;
+        }
     }
 
-finish2:
-    g_object_unref(proxy);
-finish1:
-    g_object_unref(connection);
-finish0:
+finish:
+    if (methodArgs)
+        g_variant_unref(methodArgs);
+    USERDB_TRACE(userdb_client, call_return, requestId, methodName, response ? 0 : -1);
+    if (ownRequestId)
+        userdb_trace_end();
     return response;
 }
 
@@ -59,10 +210,19 @@ void free_group_entry(struct GroupEntry *entry)
     if (entry->members) {
         char **s = &entry->members[0];
 
-        while (*s != NULL) {
+        /* Members pointing into a mapping are not allocated one by one */
+        while (*s != NULL && !entry->mapping) {
             free(*s);
             s++;
         }
+
+        free(entry->members);
+        entry->members = NULL;
+    }
+
+    if (entry->mapping) {
+        munmap(entry->mapping, entry->mappingSize);
+        entry->mapping = NULL;
     }
 }
 
@@ -73,253 +233,435 @@ void free_user_entry(UserEntry *entry)
         entry->name = NULL;
     }
 }
-char **list_groups(size_t *const pCount)
+
+/* Serialized reply data, NULL if the reply does not have the type the generated decoder expects */
+static const void *reply_data(GVariant *response, const char *type, size_t *pSize)
 {
-    char **groups = NULL;
+    const gchar *actual = g_variant_get_type_string(response);
+    if (strcmp(actual, type) != 0) {
+        fprintf(stderr, "Unexpected reply type %s, expected %s\n", actual, type);
+        return NULL;
+    }
 
-    GVariant *response = call_dbus("ListGroups", NULL);
-    if (!response) {
-        fprintf(stderr, "Failed to get response\n");
-        goto finish2;
+    *pSize = g_variant_get_size(response);
+    return g_variant_get_data(response);
+}
+
+static char **copy_strv(const UserDbStrv *strv, size_t *pCount)
+{
+    char **items = malloc(sizeof(char *) * (strv->count + 1));
+
+    for (size_t i = 0; i < strv->count; ++i)
+        items[i] = strdup(userdb_strv_get(strv, i));
+
+    items[strv->count] = NULL;
+    if (pCount)
+        *pCount = strv->count;
+    return items;
+}
+
+/*
+ * Maps the blob of names that a *Fd reply passed in a memfd instead of inline. Returns 1 and fills the view and the
+ * mapping if there is one, 0 if the names are inline, -1 on error.
+ */
+static int map_name_blob(GUnixFDList *fdList, const UserDbArray32 *handles, UserDbBlob *blob, void **pMapping,
+        size_t *pSize)
+{
+    GError *error = NULL;
+    struct stat st;
+    int ret = -1;
+    int fd = -1;
+
+    if (handles->count == 0)
+        return 0;
+
+    int32_t handle = userdb_array32_get_i32(handles, 0);
+    if (handles->count != 1 || !fdList || handle < 0 || handle >= g_unix_fd_list_get_length(fdList)) {
+        fprintf(stderr, "Invalid reply memfd handle\n");
+        goto finish;
     }
 
-    GVariant *tupleElem = g_variant_get_child_value(response, 0);
-    if (!tupleElem) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
+    fd = g_unix_fd_list_get(fdList, handle, &error);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to get reply memfd: %s\n", error->message);
+        g_error_free(error);
+        goto finish;
     }
 
-    size_t count = 0;
-    /* Parse the response message */
-    const gchar **constGroups = g_variant_get_strv(tupleElem, &count);
+    /* The service can no longer write or truncate the memfd, so the mapping stays valid and consistent */
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+        fprintf(stderr, "Reply memfd is not sealed\n");
+        goto finish;
+    }
 
-    if (constGroups == NULL) {
-        fprintf(stderr, "Failed to get string array\n");
-        if (pCount)
-            *pCount = 0;
-        goto finish4;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        fprintf(stderr, "Invalid reply memfd size\n");
+        goto finish;
     }
-    else {
-        groups = malloc(sizeof(char *) * (count + 1));
-        memset(groups, 0, sizeof(char *) * (count + 1));
 
-        for (size_t i = 0; i < count; ++i) {
-            groups[i] = strdup(constGroups[i]);
-        }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Failed to map reply memfd: %s\n", strerror(errno));
+        goto finish;
+    }
 
-        groups[count] = NULL;
-        if (pCount)
-            *pCount = count;
+    if (userdb_blob_open(mapping, st.st_size, blob) < 0) {
+        fprintf(stderr, "Malformed reply memfd\n");
+        munmap(mapping, st.st_size);
+        goto finish;
     }
 
-finish4:
-    g_variant_unref(tupleElem);
-finish3:
-    g_variant_unref(response);
-finish2:
-    return groups;
+    *pMapping = mapping;
+    *pSize = st.st_size;
+    ret = 1;
+
+finish:
+    if (fd >= 0)
+        close(fd);
+    return ret;
 }
 
-char **list_users(size_t *const pCount)
+/* Fills the members from the inline array or from the blob, whose mapping the entry then keeps */
+static int decode_members(
+        GUnixFDList *fdList, const UserDbStrv *members, const UserDbArray32 *handles, struct GroupEntry *pEntry)
 {
-    char **users = NULL;
+    UserDbBlob blob;
 
-    GVariant *response = call_dbus("ListUsers", NULL);
-    if (!response) {
-        fprintf(stderr, "Failed to get response\n");
-        goto finish2;
+    pEntry->mapping = NULL;
+    pEntry->mappingSize = 0;
+
+    int mapped = map_name_blob(fdList, handles, &blob, &pEntry->mapping, &pEntry->mappingSize);
+    if (mapped < 0)
+        return -1;
+
+    if (!mapped) {
+        pEntry->members = copy_strv(members, &pEntry->membersCount);
+        return 0;
     }
-    GVariant *tupleElem = g_variant_get_child_value(response, 0);
-    if (!tupleElem) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
+
+    pEntry->members = malloc(sizeof(char *) * (blob.count + 1));
+    for (size_t i = 0; i < blob.count; ++i)
+        pEntry->members[i] = (char *)userdb_blob_get(&blob, i);
+    pEntry->members[blob.count] = NULL;
+    pEntry->membersCount = blob.count;
+    return 0;
+}
+
+/* ListUsersFd and ListGroupsFd replies have the same layout */
+char **decode_name_list(GVariant *response, GUnixFDList *fdList, size_t *const pCount)
+{
+    UserDbListUsersFdOut reply;
+    UserDbBlob blob;
+    void *mapping = NULL;
+    size_t mappingSize = 0;
+    size_t size = 0;
+
+    if (pCount)
+        *pCount = 0;
+
+    const void *data = reply_data(response, USERDB_LIST_USERS_FD_OUT_TYPE, &size);
+    if (!data || userdb_ListUsersFd_out_decode(data, size, &reply) < 0) {
+        fprintf(stderr, "Malformed name list\n");
+        return NULL;
     }
 
-    size_t count = 0;
-    /* Parse the response message */
-    const gchar **constUsers = g_variant_get_strv(tupleElem, &count);
+    int mapped = map_name_blob(fdList, &reply.usersBlob, &blob, &mapping, &mappingSize);
+    if (mapped < 0)
+        return NULL;
+    if (!mapped)
+        return copy_strv(&reply.users, pCount);
+
+    char **names = malloc(sizeof(char *) * (blob.count + 1));
+    for (size_t i = 0; i < blob.count; ++i)
+        names[i] = strdup(userdb_blob_get(&blob, i));
+    names[blob.count] = NULL;
+    if (pCount)
+        *pCount = blob.count;
+
+    munmap(mapping, mappingSize);
+    return names;
+}
 
-    if (constUsers == NULL) {
-        fprintf(stderr, "Failed to get string array\n");
+char **list_groups(size_t *const pCount)
+{
+    GUnixFDList *fdList = NULL;
+    GVariant *response = call_dbus("ListGroupsFd", NULL, &fdList);
+    if (!response) {
+        fprintf(stderr, "Failed to get response\n");
         if (pCount)
             *pCount = 0;
-        goto finish4;
+        return NULL;
     }
-    else {
-        users = malloc(sizeof(char *) * (count + 1));
-        memset(users, 0, sizeof(char *) * (count + 1));
 
-        for (size_t i = 0; i < count; ++i) {
-            users[i] = strdup(constUsers[i]);
-        }
+    char **groups = decode_name_list(response, fdList, pCount);
+    g_variant_unref(response);
+    if (fdList)
+        g_object_unref(fdList);
+    return groups;
+}
 
-        users[count] = NULL;
+char **list_users(size_t *const pCount)
+{
+    GUnixFDList *fdList = NULL;
+    GVariant *response = call_dbus("ListUsersFd", NULL, &fdList);
+    if (!response) {
+        fprintf(stderr, "Failed to get response\n");
         if (pCount)
-            *pCount = count;
+            *pCount = 0;
+        return NULL;
     }
 
-finish4:
-    g_variant_unref(tupleElem);
-finish3:
+    char **users = decode_name_list(response, fdList, pCount);
     g_variant_unref(response);
-finish2:
+    if (fdList)
+        g_object_unref(fdList);
     return users;
 }
 
-static void get_gvariant_group_members(GVariant *membersVariant, struct GroupEntry *pEntry)
+static char **search_names(const char *method, const char *prefix, uint32_t limit, const char *cursor,
+        size_t *const pCount, char **pNextCursor)
 {
-    size_t count = 0;
-    /* Parse the response message */
-    const gchar **constMembers = g_variant_get_strv(membersVariant, &count);
+    char **names = NULL;
 
-    pEntry->members = malloc(sizeof(char *) * (count + 1));
-    memset(pEntry->members, 0, sizeof(char *) * (count + 1));
+    if (pCount)
+        *pCount = 0;
+    *pNextCursor = NULL;
 
-    for (size_t i = 0; i < count; ++i) {
-        pEntry->members[i] = strdup(constMembers[i]);
+    /* SearchUsers and SearchGroups share their argument and reply layouts */
+    GVariant *args =
+            USERDB_ARGS(SearchUsers, USERDB_SEARCH_USERS_IN_TYPE, prefix ? prefix : "", limit, cursor ? cursor : "");
+    GVariant *response = call_dbus(method, args, NULL);
+    if (!response) {
+        fprintf(stderr, "Failed to get response\n");
+        return NULL;
+    }
+
+    UserDbSearchUsersOut reply;
+    size_t size = 0;
+    const void *data = reply_data(response, USERDB_SEARCH_USERS_OUT_TYPE, &size);
+    if (!data || userdb_SearchUsers_out_decode(data, size, &reply) < 0) {
+        fprintf(stderr, "Malformed search reply\n");
+        goto finish;
     }
 
-    pEntry->members[count] = NULL;
-    pEntry->membersCount = count;
+    names = copy_strv(&reply.users, pCount);
+    if (reply.nextCursor[0] != '\0')
+        *pNextCursor = strdup(reply.nextCursor);
+
+finish:
+    g_variant_unref(response);
+    return names;
 }
 
-int get_group_by_name(const char *name, struct GroupEntry *pEntry)
+char **search_users(const char *prefix, uint32_t limit, const char *cursor, size_t *const pCount, char **pNextCursor)
 {
-    int ret = -1;
+    return search_names("SearchUsers", prefix, limit, cursor, pCount, pNextCursor);
+}
 
-    GVariant *response = call_dbus("GetGroupByName", g_variant_new("(s)", name));
-    if (!response) {
-        fprintf(stderr, "Failed to get response\n");
-        goto finish4;
-    }
-    GVariant *gidVariant = g_variant_get_child_value(response, 0);
-    if (!gidVariant) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
-    }
+char **search_groups(const char *prefix, uint32_t limit, const char *cursor, size_t *const pCount, char **pNextCursor)
+{
+    return search_names("SearchGroups", prefix, limit, cursor, pCount, pNextCursor);
+}
 
-    pEntry->gid = g_variant_get_uint32(gidVariant);
-    g_variant_unref(gidVariant);
+int decode_group_by_name(GVariant *response, GUnixFDList *fdList, const char *name, struct GroupEntry *pEntry)
+{
+    UserDbGetGroupByNameFdOut reply;
+    size_t size = 0;
 
-    GVariant *membersVariant = g_variant_get_child_value(response, 1);
-    if (!membersVariant) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
+    const void *data = reply_data(response, USERDB_GET_GROUP_BY_NAME_FD_OUT_TYPE, &size);
+    if (!data || userdb_GetGroupByNameFd_out_decode(data, size, &reply) < 0) {
+        fprintf(stderr, "Malformed group reply\n");
+        return -1;
     }
 
-    get_gvariant_group_members(membersVariant, pEntry);
-
-    g_variant_unref(membersVariant);
+    if (decode_members(fdList, &reply.members, &reply.membersBlob, pEntry) < 0)
+        return -1;
 
     pEntry->name = strdup(name);
+    pEntry->gid = reply.gid;
 
-    ret = 0;
-
-finish3:
-    g_variant_unref(response);
-finish4:
-    return ret;
+    return 0;
 }
 
-int get_group_by_id(gid_t gid, struct GroupEntry *pEntry)
+int decode_group_by_id(GVariant *response, GUnixFDList *fdList, gid_t gid, struct GroupEntry *pEntry)
 {
-    int ret = -1;
+    UserDbGetGroupByIdFdOut reply;
+    size_t size = 0;
 
-    GVariant *response = call_dbus("GetGroupById", g_variant_new("(u)", gid));
-    if (!response) {
-        fprintf(stderr, "Failed to get response\n");
-        goto finish4;
+    const void *data = reply_data(response, USERDB_GET_GROUP_BY_ID_FD_OUT_TYPE, &size);
+    if (!data || userdb_GetGroupByIdFd_out_decode(data, size, &reply) < 0) {
+        fprintf(stderr, "Malformed group reply\n");
+        return -1;
     }
-    GVariant *strVariant = g_variant_get_child_value(response, 0);
-    if (!strVariant) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
+
+    if (decode_members(fdList, &reply.members, &reply.membersBlob, pEntry) < 0)
+        return -1;
+
+    pEntry->name = strdup(reply.name);
+    pEntry->gid = gid;
+
+    return 0;
+}
+
+int decode_user_by_name(GVariant *response, const char *name, UserEntry *pEntry)
+{
+    UserDbGetUserByNameOut reply;
+    size_t size = 0;
+
+    const void *data = reply_data(response, USERDB_GET_USER_BY_NAME_OUT_TYPE, &size);
+    if (!data || userdb_GetUserByName_out_decode(data, size, &reply) < 0) {
+        fprintf(stderr, "Malformed user reply\n");
+        return -1;
     }
 
-    pEntry->name = strdup(g_variant_get_string(strVariant, NULL));
-    g_variant_unref(strVariant);
+    pEntry->name = strdup(name);
+    pEntry->uid = reply.uid;
+    pEntry->gid = reply.gid;
+
+    return 0;
+}
+
+int decode_user_by_id(GVariant *response, uid_t uid, UserEntry *pEntry)
+{
+    UserDbGetUserByIdOut reply;
+    size_t size = 0;
 
-    GVariant *membersVariant = g_variant_get_child_value(response, 1);
-    if (!membersVariant) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
+    const void *data = reply_data(response, USERDB_GET_USER_BY_ID_OUT_TYPE, &size);
+    if (!data || userdb_GetUserById_out_decode(data, size, &reply) < 0) {
+        fprintf(stderr, "Malformed user reply\n");
+        return -1;
     }
 
-    get_gvariant_group_members(membersVariant, pEntry);
+    pEntry->name = strdup(reply.name);
+    pEntry->uid = uid;
+    pEntry->gid = reply.gid;
 
-    g_variant_unref(membersVariant);
+    return 0;
+}
 
-    pEntry->gid = gid;
+int get_group_by_name(const char *name, struct GroupEntry *pEntry)
+{
+    if (cache_get_group_by_name(name, pEntry) == 0)
+        return 0;
 
-    ret = 0;
+    GUnixFDList *fdList = NULL;
+    GVariant *response = call_dbus(
+            "GetGroupByNameFd", USERDB_ARGS(GetGroupByNameFd, USERDB_GET_GROUP_BY_NAME_FD_IN_TYPE, name), &fdList);
+    if (!response) {
+        fprintf(stderr, "Failed to get response\n");
+        return -1;
+    }
 
-finish3:
+    int ret = decode_group_by_name(response, fdList, name, pEntry);
     g_variant_unref(response);
-finish4:
+    if (fdList)
+        g_object_unref(fdList);
     return ret;
 }
 
-int get_user_by_name(const char *name, UserEntry *pEntry)
+int get_group_by_id(gid_t gid, struct GroupEntry *pEntry)
 {
-    int ret = -1;
+    if (cache_get_group_by_id(gid, pEntry) == 0)
+        return 0;
 
-    GVariant *response = call_dbus("GetUserByName", g_variant_new("(s)", name));
+    GUnixFDList *fdList = NULL;
+    GVariant *response = call_dbus(
+            "GetGroupByIdFd", USERDB_ARGS(GetGroupByIdFd, USERDB_GET_GROUP_BY_ID_FD_IN_TYPE, gid), &fdList);
     if (!response) {
         fprintf(stderr, "Failed to get response\n");
-        goto finish4;
-    }
-    GVariant *uidVariant = g_variant_get_child_value(response, 0);
-    GVariant *gidVariant = g_variant_get_child_value(response, 1);
-    if (!uidVariant || !gidVariant) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
+        return -1;
     }
 
-    pEntry->name = strdup(name);
-
-    pEntry->uid = g_variant_get_uint32(uidVariant);
-    g_variant_unref(uidVariant);
-
-    pEntry->gid = g_variant_get_uint32(gidVariant);
-    g_variant_unref(gidVariant);
+    int ret = decode_group_by_id(response, fdList, gid, pEntry);
+    g_variant_unref(response);
+    if (fdList)
+        g_object_unref(fdList);
+    return ret;
+}
 
-    ret = 0;
+int get_user_by_name(const char *name, UserEntry *pEntry)
+{
+    GVariant *response =
+            call_dbus("GetUserByName", USERDB_ARGS(GetUserByName, USERDB_GET_USER_BY_NAME_IN_TYPE, name), NULL);
+    if (!response) {
+        fprintf(stderr, "Failed to get response\n");
+        return -1;
+    }
 
-finish3:
+    int ret = decode_user_by_name(response, name, pEntry);
     g_variant_unref(response);
-finish4:
     return ret;
 }
 
 int get_user_by_id(uid_t uid, UserEntry *pEntry)
 {
-    int ret = -1;
-
-    GVariant *response = call_dbus("GetUserById", g_variant_new("(u)", uid));
+    GVariant *response = call_dbus("GetUserById", USERDB_ARGS(GetUserById, USERDB_GET_USER_BY_ID_IN_TYPE, uid), NULL);
     if (!response) {
         fprintf(stderr, "Failed to get response\n");
-        goto finish4;
+        return -1;
     }
-    GVariant *strVariant = g_variant_get_child_value(response, 0);
-    GVariant *gidVariant = g_variant_get_child_value(response, 1);
 
-    if (!strVariant || !gidVariant) {
-        fprintf(stderr, "Failed to get tuple element\n");
-        goto finish3;
+    int ret = decode_user_by_id(response, uid, pEntry);
+    g_variant_unref(response);
+    return ret;
+}
+
+int decode_user_by_name_expanded(GVariant *response, const char *name, UserEntry *pEntry)
+{
+    UserDbGetUserByNameExpandedOut reply;
+    size_t size = 0;
+
+    const void *data = reply_data(response, USERDB_GET_USER_BY_NAME_EXPANDED_OUT_TYPE, &size);
+    if (!data || userdb_GetUserByNameExpanded_out_decode(data, size, &reply) < 0) {
+        fprintf(stderr, "Malformed user reply\n");
+        return -1;
     }
 
-    pEntry->name = strdup(g_variant_get_string(strVariant, NULL));
-    g_variant_unref(strVariant);
+    pEntry->name = strdup(name);
+    pEntry->uid = reply.uid;
+    pEntry->gid = reply.gid;
+
+    /* The primary group is optional, an empty name means the service does not know it */
+    if (reply.groupName[0] != '\0') {
+        GroupEntry group = {};
+        group.name = strdup(reply.groupName);
+        group.gid = reply.gid;
+        group.members = copy_strv(&reply.groupMembers, &group.membersCount);
+        cache_put_group(&group);
+        free_group_entry(&group);
+    }
 
-    pEntry->uid = uid;
+    /* The ids are stored in native byte order at their natural alignment, they are copied as they are */
+    _Static_assert(sizeof(gid_t) == sizeof(uint32_t), "gid_t is not 32 bits");
+    cache_put_user_groups(name, (const gid_t *)reply.supplementaryGids.data, reply.supplementaryGids.count);
 
-    pEntry->gid = g_variant_get_uint32(gidVariant);
-    g_variant_unref(gidVariant);
+    return 0;
+}
 
-    ret = 0;
+int get_user_by_name_expanded(const char *name, UserEntry *pEntry)
+{
+    GVariant *response = call_dbus("GetUserByNameExpanded",
+            USERDB_ARGS(GetUserByNameExpanded, USERDB_GET_USER_BY_NAME_EXPANDED_IN_TYPE, name), NULL);
+    if (!response) {
+        fprintf(stderr, "Failed to get response\n");
+        return -1;
+    }
 
-finish3:
+    int ret = decode_user_by_name_expanded(response, name, pEntry);
     g_variant_unref(response);
-finish4:
     return ret;
 }
+
+int get_user_groups(const char *name, gid_t **pGids, size_t *pCount)
+{
+    if (cache_get_user_groups(name, pGids, pCount) == 0)
+        return 0;
+
+    UserEntry entry = {};
+    if (get_user_by_name_expanded(name, &entry) < 0)
+        return -1;
+    free_user_entry(&entry);
+
+    return cache_get_user_groups(name, pGids, pCount);
+}
@@ -1,6 +1,7 @@
 #ifndef _USERDB_CLIENT_H
 #define _USERDB_CLIENT_H
 
+#include <stdint.h>
 #include <string.h>
 
 #include <grp.h>
@@ -12,6 +13,9 @@ typedef struct GroupEntry
     gid_t gid;
     char **members;
     size_t membersCount;
+    /* Read-only mapping of the memfd a large member list was passed in, members point into it; NULL otherwise */
+    void *mapping;
+    size_t mappingSize;
 } GroupEntry;
 
 typedef struct UserEntry
@@ -21,6 +25,14 @@ typedef struct UserEntry
     gid_t gid;
 } UserEntry;
 
+/*
+ * Starts a traced request on the calling thread: the returned id is reported by the tracepoints of all client calls
+ * made until userdb_trace_end(). Calls made outside of a traced request get an id of their own.
+ */
+uint64_t userdb_trace_begin(void);
+
+void userdb_trace_end(void);
+
 void free_group_entry(GroupEntry *entry);
 
 void free_user_entry(UserEntry *entry);
@@ -29,6 +41,15 @@ char **list_groups(size_t *pCount);
 
 char **list_users(size_t *pCount);
 
+/*
+ * Names starting with prefix, in byte order, one page of at most limit names (0 for the service maximum) per call.
+ * Pass NULL as cursor for the first page and the returned *pNextCursor for the following ones. *pNextCursor is NULL
+ * after the last page, otherwise it must be freed by the caller.
+ */
+char **search_users(const char *prefix, uint32_t limit, const char *cursor, size_t *pCount, char **pNextCursor);
+
+char **search_groups(const char *prefix, uint32_t limit, const char *cursor, size_t *pCount, char **pNextCursor);
+
 int get_group_by_name(const char *name, GroupEntry *pEntry);
 
 int get_group_by_id(gid_t gid, struct GroupEntry *pEntry);
@@ -37,4 +58,14 @@ int get_user_by_name(const char *name, UserEntry *pEntry);
 
 int get_user_by_id(uid_t uid, UserEntry *pEntry);
 
+/*
+ * Same as get_user_by_name(), but the reply also carries the user's primary group and supplementary group ids.
+ * They are kept for a few seconds to answer the get_group_by_id() and get_user_groups() calls that follow a
+ * getpwnam() during login without further round trips.
+ */
+int get_user_by_name_expanded(const char *name, UserEntry *pEntry);
+
+/* Supplementary group ids of a user, not including the primary group. The array must be freed by the caller. */
+int get_user_groups(const char *name, gid_t **pGids, size_t *pCount);
+
 #endif // _USERDB_CLIENT_H
@@ -0,0 +1,446 @@
+#include "client_async.h"
+#include "client_private.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <glib-object.h>
+#include <glib.h>
+
+#include <userdb_trace.h>
+
+typedef enum RequestKind
+{
+    REQUEST_LIST,
+    REQUEST_GROUP_BY_NAME,
+    REQUEST_GROUP_BY_ID,
+    REQUEST_USER_BY_NAME,
+    REQUEST_USER_BY_ID,
+} RequestKind;
+
+typedef struct PendingRequest
+{
+    UserDbClient *client;
+    RequestKind kind;
+    guint32 serial;
+    char *name;
+    guint32 id;
+    union
+    {
+        UserDbListCallback list;
+        UserDbGroupCallback group;
+        UserDbUserCallback user;
+    } callback;
+    void *userData;
+} PendingRequest;
+
+/*
+ * GDBus reads and writes the socket in its own worker thread and hands replies over to the main context that was
+ * thread-default when the request was sent. Each client has a private main context which is driven by hand
+ * (prepare/query/check/dispatch), and the file descriptors it asks to poll are mirrored into an epoll instance so
+ * that a single fd can be handed to the embedding event loop.
+ */
+struct UserDbClient
+{
+    GMainContext *context;
+    GDBusConnection *connection;
+    GCancellable *cancellable;
+    int requestTimeout;
+
+    int epollFd;
+    GPollFD *pollFds;
+    gint pollFdsSize;
+    gint pollFdsCount;
+    /* Fds currently in the epoll set, with their events */
+    struct epoll_event *registered;
+    gint registeredCount;
+    gint priority;
+    gint timeout;
+
+    size_t pending;
+    size_t completed;
+};
+
+static int poll_events_to_epoll(gushort events)
+{
+    int ev = 0;
+    if (events & G_IO_IN)
+        ev |= EPOLLIN;
+    if (events & G_IO_OUT)
+        ev |= EPOLLOUT;
+    if (events & G_IO_PRI)
+        ev |= EPOLLPRI;
+    return ev;
+}
+
+static void update_poll_fds(UserDbClient *client)
+{
+    gint count;
+
+    g_main_context_prepare(client->context, &client->priority);
+
+    while ((count = g_main_context_query(client->context, client->priority, &client->timeout, client->pollFds,
+                    client->pollFdsSize)) > client->pollFdsSize) {
+        client->pollFds = g_renew(GPollFD, client->pollFds, count);
+        client->pollFdsSize = count;
+    }
+    client->pollFdsCount = count;
+
+    /* The wanted set, one entry per fd; the set rarely changes, so only the differences reach epoll */
+    struct epoll_event *wanted = g_new0(struct epoll_event, count > 0 ? count : 1);
+    gint wantedCount = 0;
+    for (gint i = 0; i < count; ++i) {
+        gint j = 0;
+        while (j < wantedCount && wanted[j].data.fd != client->pollFds[i].fd)
+            ++j;
+        if (j == wantedCount) {
+            wanted[j].data.fd = client->pollFds[i].fd;
+            wantedCount++;
+        }
+        wanted[j].events |= poll_events_to_epoll(client->pollFds[i].events);
+    }
+
+    for (gint i = 0; i < client->registeredCount; ++i) {
+        gint j = 0;
+        while (j < wantedCount && wanted[j].data.fd != client->registered[i].data.fd)
+            ++j;
+        if (j == wantedCount)
+            epoll_ctl(client->epollFd, EPOLL_CTL_DEL, client->registered[i].data.fd, NULL);
+    }
+
+    for (gint j = 0; j < wantedCount; ++j) {
+        gint i = 0;
+        while (i < client->registeredCount && client->registered[i].data.fd != wanted[j].data.fd)
+            ++i;
+
+        int op = EPOLL_CTL_ADD;
+        if (i < client->registeredCount) {
+            if (client->registered[i].events == wanted[j].events)
+                continue;
+            op = EPOLL_CTL_MOD;
+        }
+
+        if (epoll_ctl(client->epollFd, op, wanted[j].data.fd, &wanted[j]) < 0 && errno != EEXIST)
+            fprintf(stderr, "Failed to watch fd %d: %s\n", wanted[j].data.fd, strerror(errno));
+    }
+
+    g_free(client->registered);
+    client->registered = wanted;
+    client->registeredCount = wantedCount;
+}
+
+/* Drops every fd from the epoll set, e.g. when a new connection may have reused the number of a closed one */
+static void reset_poll_fds(UserDbClient *client)
+{
+    for (gint i = 0; i < client->registeredCount; ++i)
+        epoll_ctl(client->epollFd, EPOLL_CTL_DEL, client->registered[i].data.fd, NULL);
+    client->registeredCount = 0;
+}
+
+static GDBusConnection *connect_service(UserDbClient *client)
+{
+    GError *error = NULL;
+
+    g_main_context_push_thread_default(client->context);
+    GDBusConnection *connection = g_dbus_connection_new_for_address_sync(
+            DEFAULT_USERDB_SERVICE_PATH, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL, &error);
+    g_main_context_pop_thread_default(client->context);
+
+    if (error) {
+        fprintf(stderr, "Failed to connect to UserDB: %s\n", error->message);
+        g_error_free(error);
+    }
+    return connection;
+}
+
+/*
+ * A connection closed by the service, e.g. by an instance replaced through a hot restart, is replaced before the next
+ * request. Requests still pending on the old one complete with status -1.
+ */
+static bool ensure_connected(UserDbClient *client)
+{
+    if (!g_dbus_connection_is_closed(client->connection))
+        return true;
+
+    GDBusConnection *connection = connect_service(client);
+    if (!connection)
+        return false;
+
+    g_object_unref(client->connection);
+    client->connection = connection;
+    reset_poll_fds(client);
+    update_poll_fds(client);
+    return true;
+}
+
+UserDbClient *userdb_client_new(void)
+{
+    UserDbClient *client = g_new0(UserDbClient, 1);
+
+    client->requestTimeout = -1;
+    client->cancellable = g_cancellable_new();
+    client->context = g_main_context_new();
+    g_main_context_acquire(client->context);
+
+    client->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (client->epollFd < 0) {
+        fprintf(stderr, "Failed to create epoll instance: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    client->connection = connect_service(client);
+    if (!client->connection)
+        goto fail;
+
+    update_poll_fds(client);
+    return client;
+
+fail:
+    if (client->epollFd >= 0)
+        close(client->epollFd);
+    g_main_context_release(client->context);
+    g_main_context_unref(client->context);
+    g_object_unref(client->cancellable);
+    g_free(client);
+    return NULL;
+}
+
+void userdb_client_free(UserDbClient *client)
+{
+    if (!client)
+        return;
+
+    g_cancellable_cancel(client->cancellable);
+    while (client->pending > 0)
+        g_main_context_iteration(client->context, TRUE);
+
+    g_dbus_connection_close_sync(client->connection, NULL, NULL);
+    g_object_unref(client->connection);
+    g_object_unref(client->cancellable);
+
+    g_main_context_release(client->context);
+    g_main_context_unref(client->context);
+
+    close(client->epollFd);
+    g_free(client->pollFds);
+    g_free(client->registered);
+    g_free(client);
+}
+
+void userdb_client_set_request_timeout(UserDbClient *client, int timeoutMs)
+{
+    client->requestTimeout = timeoutMs;
+}
+
+int userdb_client_get_fd(UserDbClient *client)
+{
+    return client->epollFd;
+}
+
+int userdb_client_get_timeout(UserDbClient *client)
+{
+    update_poll_fds(client);
+    return client->timeout;
+}
+
+int userdb_client_dispatch(UserDbClient *client)
+{
+    size_t before = client->completed;
+
+    update_poll_fds(client);
+    g_poll(client->pollFds, client->pollFdsCount, 0);
+    if (g_main_context_check(client->context, client->priority, client->pollFds, client->pollFdsCount))
+        g_main_context_dispatch(client->context);
+
+    /* Re-arm the epoll set for the sources that are left */
+    update_poll_fds(client);
+
+    return (int)(client->completed - before);
+}
+
+size_t userdb_client_pending(UserDbClient *client)
+{
+    return client->pending;
+}
+
+static void on_reply(GObject *source, GAsyncResult *res, gpointer userData)
+{
+    PendingRequest *req = userData;
+    UserDbClient *client = req->client;
+    GError *error = NULL;
+    GVariant *body = NULL;
+    int status = -1;
+
+    GDBusMessage *reply = g_dbus_connection_send_message_with_reply_finish(G_DBUS_CONNECTION(source), res, &error);
+    GUnixFDList *fdList = NULL;
+    if (reply && !g_dbus_message_to_gerror(reply, &error)) {
+        body = g_dbus_message_get_body(reply);
+        fdList = g_dbus_message_get_unix_fd_list(reply);
+    }
+
+    if (error) {
+        fprintf(stderr, "Method call %u failed: %s\n", req->serial, error->message);
+        g_error_free(error);
+    }
+
+    USERDB_TRACE(userdb_client, async_reply, req->serial, body ? 0 : -1);
+
+    /* Not sent, the caller was told by a 0 serial and expects no callback */
+    if (req->serial == 0)
+        goto finish;
+
+    switch (req->kind) {
+        case REQUEST_LIST: {
+            size_t count = 0;
+            char **names = body ? decode_name_list(body, fdList, &count) : NULL;
+
+            req->callback.list(req->serial, names ? 0 : -1, names, count, req->userData);
+
+            if (names) {
+                for (size_t i = 0; i < count; ++i)
+                    free(names[i]);
+                free(names);
+            }
+            break;
+        }
+        case REQUEST_GROUP_BY_NAME:
+        case REQUEST_GROUP_BY_ID: {
+            GroupEntry entry = {};
+            if (body) {
+                status = req->kind == REQUEST_GROUP_BY_NAME ? decode_group_by_name(body, fdList, req->name, &entry)
+                                                            : decode_group_by_id(body, fdList, req->id, &entry);
+            }
+
+            req->callback.group(req->serial, status, status == 0 ? &entry : NULL, req->userData);
+            free_group_entry(&entry);
+            break;
+        }
+        case REQUEST_USER_BY_NAME:
+        case REQUEST_USER_BY_ID: {
+            UserEntry entry = {};
+            if (body) {
+                status = req->kind == REQUEST_USER_BY_NAME ? decode_user_by_name(body, req->name, &entry)
+                                                           : decode_user_by_id(body, req->id, &entry);
+            }
+
+            req->callback.user(req->serial, status, status == 0 ? &entry : NULL, req->userData);
+            free_user_entry(&entry);
+            break;
+        }
+    }
+
+finish:
+    if (reply)
+        g_object_unref(reply);
+
+    client->pending--;
+    client->completed++;
+
+    g_free(req->name);
+    g_free(req);
+}
+
+static uint32_t send_request(UserDbClient *client, PendingRequest *req, const char *methodName, GVariant *methodArgs)
+{
+    if (!ensure_connected(client)) {
+        if (methodArgs)
+            g_variant_unref(g_variant_ref_sink(methodArgs));
+        g_free(req->name);
+        g_free(req);
+        return 0;
+    }
+
+    GDBusMessage *msg = g_dbus_message_new_method_call(NULL, USERDB_OBJECT_PATH, USERDB_INTERFACE_NAME, methodName);
+    if (methodArgs)
+        g_dbus_message_set_body(msg, methodArgs);
+
+    req->client = client;
+
+    /* The reply callback and the timeout source are attached to the thread-default context */
+    g_main_context_push_thread_default(client->context);
+    g_dbus_connection_send_message_with_reply(client->connection, msg, G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+            client->requestTimeout, &req->serial, client->cancellable, on_reply, req);
+    g_main_context_pop_thread_default(client->context);
+
+    USERDB_TRACE(userdb_client, async_send, req->serial, methodName);
+
+    g_object_unref(msg);
+    client->pending++;
+
+    return req->serial;
+}
+
+uint32_t userdb_list_groups_async(UserDbClient *client, UserDbListCallback callback, void *userData)
+{
+    PendingRequest *req = g_new0(PendingRequest, 1);
+    req->kind = REQUEST_LIST;
+    req->callback.list = callback;
+    req->userData = userData;
+
+    return send_request(client, req, "ListGroupsFd", NULL);
+}
+
+uint32_t userdb_list_users_async(UserDbClient *client, UserDbListCallback callback, void *userData)
+{
+    PendingRequest *req = g_new0(PendingRequest, 1);
+    req->kind = REQUEST_LIST;
+    req->callback.list = callback;
+    req->userData = userData;
+
+    return send_request(client, req, "ListUsersFd", NULL);
+}
+
+uint32_t userdb_get_group_by_name_async(
+        UserDbClient *client, const char *name, UserDbGroupCallback callback, void *userData)
+{
+    PendingRequest *req = g_new0(PendingRequest, 1);
+    req->kind = REQUEST_GROUP_BY_NAME;
+    req->name = g_strdup(name);
+    req->callback.group = callback;
+    req->userData = userData;
+
+    return send_request(
+            client, req, "GetGroupByNameFd", USERDB_ARGS(GetGroupByNameFd, USERDB_GET_GROUP_BY_NAME_FD_IN_TYPE, name));
+}
+
+uint32_t userdb_get_group_by_id_async(UserDbClient *client, gid_t gid, UserDbGroupCallback callback, void *userData)
+{
+    PendingRequest *req = g_new0(PendingRequest, 1);
+    req->kind = REQUEST_GROUP_BY_ID;
+    req->id = gid;
+    req->callback.group = callback;
+    req->userData = userData;
+
+    return send_request(
+            client, req, "GetGroupByIdFd", USERDB_ARGS(GetGroupByIdFd, USERDB_GET_GROUP_BY_ID_FD_IN_TYPE, gid));
+}
+
+uint32_t userdb_get_user_by_name_async(
+        UserDbClient *client, const char *name, UserDbUserCallback callback, void *userData)
+{
+    PendingRequest *req = g_new0(PendingRequest, 1);
+    req->kind = REQUEST_USER_BY_NAME;
+    req->name = g_strdup(name);
+    req->callback.user = callback;
+    req->userData = userData;
+
+    return send_request(
+            client, req, "GetUserByName", USERDB_ARGS(GetUserByName, USERDB_GET_USER_BY_NAME_IN_TYPE, name));
+}
+
+uint32_t userdb_get_user_by_id_async(UserDbClient *client, uid_t uid, UserDbUserCallback callback, void *userData)
+{
+    PendingRequest *req = g_new0(PendingRequest, 1);
+    req->kind = REQUEST_USER_BY_ID;
+    req->id = uid;
+    req->callback.user = callback;
+    req->userData = userData;
+
+    return send_request(client, req, "GetUserById", USERDB_ARGS(GetUserById, USERDB_GET_USER_BY_ID_IN_TYPE, uid));
+}
@@ -0,0 +1,69 @@
+#ifndef _USERDB_CLIENT_ASYNC_H
+#define _USERDB_CLIENT_ASYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "client.h"
+
+/*
+ * Non-blocking UserDB client.
+ *
+ * A UserDbClient owns one connection to the service; any number of requests may be outstanding on it and replies
+ * are matched to requests by message serial. The client never blocks after userdb_client_new(): embed it into an
+ * external event loop by watching userdb_client_get_fd() for EPOLLIN, waiting at most userdb_client_get_timeout()
+ * milliseconds, and calling userdb_client_dispatch() whenever the fd becomes readable or the timeout expires.
+ * Completion callbacks are invoked from userdb_client_dispatch() only.
+ *
+ * A client is not thread-safe: issue requests and dispatch from the thread running the event loop.
+ */
+
+typedef struct UserDbClient UserDbClient;
+
+/*
+ * Completion callbacks. status is 0 on success and -1 on failure (unknown entry, service error, timeout or
+ * cancellation). The entry and the name list are owned by the client and are only valid during the callback.
+ */
+typedef void (*UserDbGroupCallback)(uint32_t serial, int status, const GroupEntry *entry, void *userData);
+
+typedef void (*UserDbUserCallback)(uint32_t serial, int status, const UserEntry *entry, void *userData);
+
+typedef void (*UserDbListCallback)(uint32_t serial, int status, char *const *names, size_t count, void *userData);
+
+UserDbClient *userdb_client_new(void);
+
+/* Cancels all outstanding requests, running their callbacks with status -1, and closes the connection */
+void userdb_client_free(UserDbClient *client);
+
+/* Per-request timeout in milliseconds, -1 for the D-Bus default */
+void userdb_client_set_request_timeout(UserDbClient *client, int timeoutMs);
+
+int userdb_client_get_fd(UserDbClient *client);
+
+/* Milliseconds until userdb_client_dispatch() must be called even without fd activity, -1 for no deadline */
+int userdb_client_get_timeout(UserDbClient *client);
+
+/* Runs all completions that are ready and returns their number; never blocks */
+int userdb_client_dispatch(UserDbClient *client);
+
+size_t userdb_client_pending(UserDbClient *client);
+
+/*
+ * Each call returns the serial of the request, which is also passed to its callback, or 0 if it was not sent, in
+ * which case the callback is never run. A connection closed by the service is re-established before the next request.
+ */
+uint32_t userdb_list_groups_async(UserDbClient *client, UserDbListCallback callback, void *userData);
+
+uint32_t userdb_list_users_async(UserDbClient *client, UserDbListCallback callback, void *userData);
+
+uint32_t userdb_get_group_by_name_async(
+        UserDbClient *client, const char *name, UserDbGroupCallback callback, void *userData);
+
+uint32_t userdb_get_group_by_id_async(UserDbClient *client, gid_t gid, UserDbGroupCallback callback, void *userData);
+
+uint32_t userdb_get_user_by_name_async(
+        UserDbClient *client, const char *name, UserDbUserCallback callback, void *userData);
+
+uint32_t userdb_get_user_by_id_async(UserDbClient *client, uid_t uid, UserDbUserCallback callback, void *userData);
+
+#endif // _USERDB_CLIENT_ASYNC_H
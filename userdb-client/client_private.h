@@ -0,0 +1,46 @@
+#ifndef _USERDB_CLIENT_PRIVATE_H
+#define _USERDB_CLIENT_PRIVATE_H
+
+#include <gio/gunixfdlist.h>
+#include <glib.h>
+
+#include <userdb_marshal.h>
+
+#include "client.h"
+
+#define DEFAULT_USERDB_SERVICE_PATH "unix:path=/tmp/user-db.sock"
+#define USERDB_OBJECT_PATH "/com/example/UserDb"
+#define USERDB_INTERFACE_NAME "com.example.UserDb"
+
+/*
+ * Arguments of method, serialized by the generated marshaller instead of being built from a format string, e.g.
+ * USERDB_ARGS(GetUserById, USERDB_GET_USER_BY_ID_IN_TYPE, uid). The type string is a valid GVariantType as it is.
+ */
+#define USERDB_ARGS(method, type, ...)                                                                                 \
+    ({                                                                                                                 \
+        size_t _size = userdb_##method##_in_size(__VA_ARGS__);                                                         \
+        void *_data = g_malloc(_size);                                                                                 \
+        userdb_##method##_in_encode(_data, _size, __VA_ARGS__);                                                        \
+        g_variant_new_from_data((const GVariantType *)(type), _data, _size, TRUE, g_free, _data);                      \
+    })
+
+/*
+ * Reply decoders shared by the blocking and the asynchronous API.
+ * Each takes the reply body tuple and fills the entry; the key of the request is passed in since
+ * the service does not echo it back.
+ */
+/* Decoders of the *Fd methods, fdList holds the memfd of a large name list and may be NULL for a small one */
+char **decode_name_list(GVariant *response, GUnixFDList *fdList, size_t *pCount);
+
+int decode_group_by_name(GVariant *response, GUnixFDList *fdList, const char *name, GroupEntry *pEntry);
+
+int decode_group_by_id(GVariant *response, GUnixFDList *fdList, gid_t gid, GroupEntry *pEntry);
+
+int decode_user_by_name(GVariant *response, const char *name, UserEntry *pEntry);
+
+/* Also stores the bundled group records in the cache */
+int decode_user_by_name_expanded(GVariant *response, const char *name, UserEntry *pEntry);
+
+int decode_user_by_id(GVariant *response, uid_t uid, UserEntry *pEntry);
+
+#endif // _USERDB_CLIENT_PRIVATE_H
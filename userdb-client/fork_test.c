@@ -0,0 +1,71 @@
+#include "client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Checks that a child forked after a lookup gets a connection of its own: the connection inherited from the parent
+ * has no worker thread in the child, so a lookup through it would hang.
+ *
+ * Needs a running userdb-service, the test is skipped otherwise.
+ */
+
+#define SKIP_EXIT_CODE 77
+#define CHILD_TIMEOUT_S 5
+
+static void free_string_array(char **array)
+{
+    for (char **s = array; s && *s; ++s)
+        free(*s);
+    free(array);
+}
+
+/* Returns 0 if the service answered */
+static int lookup(const char *who)
+{
+    size_t count = 0;
+    char **groups = list_groups(&count);
+    if (!groups) {
+        fprintf(stderr, "[TEST] %s: lookup failed\n", who);
+        return -1;
+    }
+    printf("[TEST] %s: %zu groups\n", who, count);
+    free_string_array(groups);
+    return 0;
+}
+
+int main(void)
+{
+    if (lookup("parent before fork") < 0) {
+        fprintf(stderr, "[TEST] userdb-service is not running, skipping\n");
+        return SKIP_EXIT_CODE;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+
+    if (pid == 0) {
+        /* A lookup on the inherited connection would wait for the 25 s D-Bus timeout */
+        alarm(CHILD_TIMEOUT_S);
+        _exit(lookup("child") == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int ret = lookup("parent after fork");
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "[TEST] child killed by signal %d\n", WTERMSIG(status));
+        return EXIT_FAILURE;
+    }
+
+    return ret == 0 && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
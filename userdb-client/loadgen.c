@@ -0,0 +1,676 @@
+#include "client.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Load generator for userdb-service.
+ *
+ * Requests are scheduled open-loop: a dispatcher thread computes the intended start time of every request (from the
+ * target rate or from the timestamps of a recorded trace) and hands them to a pool of worker threads. Latency is
+ * measured from the intended start time, so time spent waiting for a free worker is accounted for and a saturated
+ * service shows up as growing latency instead of silently lowering the offered load.
+ */
+
+#define QUEUE_SIZE 4096
+#define MISS_ID_BASE 0x7fff0000u
+
+/* Log-linear histogram: 64 power-of-two ranges of nanoseconds, each split in 16 linear sub-buckets */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_COUNT)
+
+typedef enum OpType
+{
+    OP_USER_BY_NAME,
+    OP_USER_BY_ID,
+    OP_GROUP_BY_NAME,
+    OP_GROUP_BY_ID,
+    OP_LIST_USERS,
+    OP_LIST_GROUPS,
+    OP_COUNT
+} OpType;
+
+static const char *const opNames[OP_COUNT] = {
+        "user-name",
+        "user-id",
+        "group-name",
+        "group-id",
+        "list-users",
+        "list-groups",
+};
+
+typedef struct Histogram
+{
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t errors;
+    uint64_t maxNs;
+} Histogram;
+
+typedef struct Request
+{
+    OpType op;
+    bool hit;
+    char *key; /* Optional key taken from a trace, owned by the request */
+    bool anyOutcome; /* Trace entry without a recorded status: found and not found are both valid */
+    uint64_t scheduledNs;
+} Request;
+
+typedef struct Worker
+{
+    pthread_t thread;
+    Histogram hist[OP_COUNT];
+} Worker;
+
+typedef struct KeySet
+{
+    char **names;
+    uint32_t *ids;
+    size_t count;
+} KeySet;
+
+static struct
+{
+    unsigned mix[OP_COUNT];
+    double hitRatio;
+    unsigned concurrency;
+    double rps;
+    double duration;
+    double speed;
+    const char *tracePath;
+    double sweepStart, sweepEnd, sweepStep;
+    bool sweep;
+} config = {
+        .mix = {40, 20, 20, 20, 0, 0},
+        .hitRatio = 0.9,
+        .concurrency = 8,
+        .rps = 100,
+        .duration = 10,
+        .speed = 1.0,
+};
+
+static KeySet users;
+static KeySet groups;
+
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    Request items[QUEUE_SIZE];
+    size_t head;
+    size_t tail;
+    bool done;
+    uint64_t dropped;
+} queue = {.mutex = PTHREAD_MUTEX_INITIALIZER, .notEmpty = PTHREAD_COND_INITIALIZER};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+    struct timespec ts = {.tv_sec = deadline / 1000000000ull, .tv_nsec = deadline % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static size_t hist_index(uint64_t ns)
+{
+    if (ns < HIST_SUB_COUNT)
+        return ns;
+
+    unsigned msb = 63 - __builtin_clzll(ns);
+    unsigned shift = msb - HIST_SUB_BITS;
+    return (size_t)(shift + 1) * HIST_SUB_COUNT + ((ns >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+static uint64_t hist_value(size_t index)
+{
+    if (index < HIST_SUB_COUNT)
+        return index;
+
+    unsigned shift = index / HIST_SUB_COUNT - 1;
+    return ((uint64_t)(HIST_SUB_COUNT | (index % HIST_SUB_COUNT)) << shift);
+}
+
+static void hist_record(Histogram *h, uint64_t ns, bool error)
+{
+    h->buckets[hist_index(ns)]++;
+    h->count++;
+    if (error)
+        h->errors++;
+    if (ns > h->maxNs)
+        h->maxNs = ns;
+}
+
+static void hist_merge(Histogram *dst, const Histogram *src)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; ++i)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->errors += src->errors;
+    if (src->maxNs > dst->maxNs)
+        dst->maxNs = src->maxNs;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double p)
+{
+    if (h->count == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)ceil(p / 100.0 * h->count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= target && seen > 0)
+            return hist_value(i);
+    }
+    return h->maxNs;
+}
+
+static void free_string_array(char **array)
+{
+    if (!array)
+        return;
+
+    for (char **s = array; *s != NULL; ++s)
+        free(*s);
+    free(array);
+}
+
+static void load_keys(void)
+{
+    size_t count = 0;
+    char **names = list_users(&count);
+
+    users.names = names;
+    users.ids = calloc(count + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < count; ++i) {
+        UserEntry entry = {};
+        if (get_user_by_name(names[i], &entry) == 0) {
+            users.ids[users.count] = entry.uid;
+            users.names[users.count++] = names[i];
+            free_user_entry(&entry);
+        }
+        else {
+            free(names[i]);
+        }
+    }
+    if (users.names)
+        users.names[users.count] = NULL;
+
+    count = 0;
+    names = list_groups(&count);
+
+    groups.names = names;
+    groups.ids = calloc(count + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < count; ++i) {
+        GroupEntry entry = {};
+        if (get_group_by_name(names[i], &entry) == 0) {
+            groups.ids[groups.count] = entry.gid;
+            groups.names[groups.count++] = names[i];
+        }
+        else {
+            free(names[i]);
+        }
+        free_group_entry(&entry);
+    }
+    if (groups.names)
+        groups.names[groups.count] = NULL;
+
+    fprintf(stderr, "[LOADGEN] Loaded %zu users and %zu groups as hit keys\n", users.count, groups.count);
+}
+
+static bool execute(const Request *req, unsigned *seed)
+{
+    const KeySet *keys = (req->op == OP_USER_BY_NAME || req->op == OP_USER_BY_ID) ? &users : &groups;
+    bool hit = req->key ? req->hit : req->hit && keys->count > 0;
+    size_t pick = keys->count ? (size_t)rand_r(seed) % keys->count : 0;
+    char missName[64];
+    const char *name = req->key;
+    uint32_t id = 0;
+
+    if (req->key) {
+        id = (uint32_t)strtoul(req->key, NULL, 10);
+    }
+    else if (hit) {
+        name = keys->names[pick];
+        id = keys->ids[pick];
+    }
+    else {
+        id = MISS_ID_BASE + (uint32_t)rand_r(seed) % 0xffff;
+        snprintf(missName, sizeof(missName), "loadgen-miss-%u", id);
+        name = missName;
+    }
+
+    int ret = -1;
+    switch (req->op) {
+        case OP_USER_BY_NAME:
+        case OP_USER_BY_ID: {
+            UserEntry entry = {};
+            ret = req->op == OP_USER_BY_NAME ? get_user_by_name(name, &entry) : get_user_by_id(id, &entry);
+            free_user_entry(&entry);
+            break;
+        }
+        case OP_GROUP_BY_NAME:
+        case OP_GROUP_BY_ID: {
+            GroupEntry entry = {};
+            ret = req->op == OP_GROUP_BY_NAME ? get_group_by_name(name, &entry) : get_group_by_id(id, &entry);
+            free_group_entry(&entry);
+            break;
+        }
+        case OP_LIST_USERS:
+        case OP_LIST_GROUPS: {
+            char **list = req->op == OP_LIST_USERS ? list_users(NULL) : list_groups(NULL);
+            ret = list ? 0 : -1;
+            free_string_array(list);
+            break;
+        }
+        default:
+            break;
+    }
+
+    /* Listings always succeed; a miss is expected to fail, so only count unexpected outcomes as errors */
+    if (req->op == OP_LIST_USERS || req->op == OP_LIST_GROUPS)
+        return ret == 0;
+    /* The client reports a record not found like a failed call, so neither can be told apart from the other */
+    if (req->anyOutcome)
+        return true;
+    return hit ? ret == 0 : ret != 0;
+}
+
+static bool queue_push(const Request *req)
+{
+    pthread_mutex_lock(&queue.mutex);
+
+    bool pushed = queue.tail - queue.head < QUEUE_SIZE;
+    if (pushed) {
+        queue.items[queue.tail++ % QUEUE_SIZE] = *req;
+        pthread_cond_signal(&queue.notEmpty);
+    }
+    else {
+        queue.dropped++;
+    }
+
+    pthread_mutex_unlock(&queue.mutex);
+    return pushed;
+}
+
+static bool queue_pop(Request *req)
+{
+    pthread_mutex_lock(&queue.mutex);
+
+    while (queue.head == queue.tail && !queue.done)
+        pthread_cond_wait(&queue.notEmpty, &queue.mutex);
+
+    bool popped = queue.head != queue.tail;
+    if (popped)
+        *req = queue.items[queue.head++ % QUEUE_SIZE];
+
+    pthread_mutex_unlock(&queue.mutex);
+    return popped;
+}
+
+static void queue_reset(void)
+{
+    pthread_mutex_lock(&queue.mutex);
+
+    queue.head = queue.tail = 0;
+    queue.done = false;
+    queue.dropped = 0;
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+static void queue_finish(void)
+{
+    pthread_mutex_lock(&queue.mutex);
+
+    queue.done = true;
+    pthread_cond_broadcast(&queue.notEmpty);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    unsigned seed = (unsigned)(uintptr_t)worker ^ (unsigned)now_ns();
+    Request req;
+
+    while (queue_pop(&req)) {
+        /* Open-loop: never start ahead of schedule, but account for time spent queued behind busy workers */
+        sleep_until_ns(req.scheduledNs);
+        bool ok = execute(&req, &seed);
+        hist_record(&worker->hist[req.op], now_ns() - req.scheduledNs, !ok);
+        free(req.key);
+    }
+
+    return NULL;
+}
+
+static OpType pick_op(unsigned *seed)
+{
+    unsigned total = 0;
+    for (int i = 0; i < OP_COUNT; ++i)
+        total += config.mix[i];
+
+    unsigned r = (unsigned)rand_r(seed) % total;
+    for (int i = 0; i < OP_COUNT; ++i) {
+        if (r < config.mix[i])
+            return (OpType)i;
+        r -= config.mix[i];
+    }
+    return OP_USER_BY_NAME;
+}
+
+static int parse_op(const char *name)
+{
+    for (int i = 0; i < OP_COUNT; ++i) {
+        if (strcmp(name, opNames[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Generates requests at a fixed rate for the configured duration */
+static void dispatch_synthetic(double rps, uint64_t start)
+{
+    unsigned seed = (unsigned)start;
+    uint64_t intervalNs = (uint64_t)(1e9 / rps);
+    uint64_t count = (uint64_t)(config.duration * rps);
+
+    for (uint64_t i = 0; i < count; ++i) {
+        Request req = {
+                .op = pick_op(&seed),
+                .hit = (double)rand_r(&seed) / RAND_MAX < config.hitRatio,
+                .scheduledNs = start + i * intervalNs,
+        };
+        /* Stay ahead of the schedule without flooding the queue */
+        if (req.scheduledNs > now_ns() + 10000000ull)
+            sleep_until_ns(req.scheduledNs - 10000000ull);
+        queue_push(&req);
+    }
+}
+
+/*
+ * Replays a trace preserving the original inter-arrival times (scaled by the speed factor).
+ * Each line is "<timestamp-seconds> <op> <key> <status>", where op is one of the mix names, key is a name or a numeric
+ * id and status is "hit" or "miss", the outcome the lookup had when recorded. Without a status either outcome counts
+ * as a success.
+ */
+static int dispatch_trace(FILE *trace, uint64_t start)
+{
+    char line[512];
+    double first = -1;
+    size_t lineNo = 0;
+
+    while (fgets(line, sizeof(line), trace)) {
+        char opName[32];
+        char key[256] = "";
+        char status[8] = "";
+        double ts;
+
+        lineNo++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (sscanf(line, "%lf %31s %255s %7s", &ts, opName, key, status) < 2 ||
+                (status[0] && strcmp(status, "hit") != 0 && strcmp(status, "miss") != 0)) {
+            fprintf(stderr, "[LOADGEN] %s:%zu: malformed trace line\n", config.tracePath, lineNo);
+            return -1;
+        }
+
+        int op = parse_op(opName);
+        if (op < 0) {
+            fprintf(stderr, "[LOADGEN] %s:%zu: unknown operation %s\n", config.tracePath, lineNo, opName);
+            return -1;
+        }
+
+        if (first < 0)
+            first = ts;
+
+        Request req = {
+                .op = (OpType)op,
+                .hit = strcmp(status, "miss") != 0,
+                .key = key[0] ? strdup(key) : NULL,
+                .anyOutcome = key[0] && !status[0],
+                .scheduledNs = start + (uint64_t)((ts - first) / config.speed * 1e9),
+        };
+        if (req.scheduledNs > now_ns() + 10000000ull)
+            sleep_until_ns(req.scheduledNs - 10000000ull);
+        if (!queue_push(&req))
+            free(req.key);
+    }
+
+    return 0;
+}
+
+typedef struct RunResult
+{
+    Histogram total;
+    Histogram perOp[OP_COUNT];
+    uint64_t dropped;
+    double elapsed;
+} RunResult;
+
+static int run(double rps, FILE *trace, RunResult *result)
+{
+    Worker *workers = calloc(config.concurrency, sizeof(Worker));
+    int ret = 0;
+
+    memset(result, 0, sizeof(*result));
+    queue_reset();
+
+    for (unsigned i = 0; i < config.concurrency; ++i)
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+
+    uint64_t start = now_ns() + 10000000ull;
+    if (trace)
+        ret = dispatch_trace(trace, start);
+    else
+        dispatch_synthetic(rps, start);
+
+    queue_finish();
+
+    for (unsigned i = 0; i < config.concurrency; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        for (int op = 0; op < OP_COUNT; ++op) {
+            hist_merge(&result->perOp[op], &workers[i].hist[op]);
+            hist_merge(&result->total, &workers[i].hist[op]);
+        }
+    }
+
+    result->elapsed = (now_ns() - start) / 1e9;
+    result->dropped = queue.dropped;
+    free(workers);
+    return ret;
+}
+
+static void print_hist(const char *label, const Histogram *h)
+{
+    printf("%-12s %9llu %7llu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+            label,
+            (unsigned long long)h->count,
+            (unsigned long long)h->errors,
+            hist_percentile(h, 50) / 1e6,
+            hist_percentile(h, 90) / 1e6,
+            hist_percentile(h, 99) / 1e6,
+            hist_percentile(h, 99.9) / 1e6,
+            h->maxNs / 1e6);
+}
+
+static void print_result(const RunResult *r)
+{
+    printf("%-12s %9s %7s %9s %9s %9s %9s %9s\n", "op", "count", "errors", "p50(ms)", "p90(ms)", "p99(ms)",
+            "p99.9(ms)", "max(ms)");
+    for (int op = 0; op < OP_COUNT; ++op) {
+        if (r->perOp[op].count)
+            print_hist(opNames[op], &r->perOp[op]);
+    }
+    print_hist("total", &r->total);
+    printf("throughput: %.1f req/s, dropped: %llu\n", r->total.count / r->elapsed, (unsigned long long)r->dropped);
+}
+
+/*
+ * Increases the offered rate step by step and reports the first rate the service cannot sustain: either requests
+ * were dropped because all workers were busy, the achieved rate fell below 95% of the offered one, or p99 latency
+ * grew past ten times the one measured at the lowest rate.
+ */
+static void run_sweep(void)
+{
+    RunResult r;
+    uint64_t baselineP99 = 0;
+    double saturation = 0;
+
+    printf("%10s %10s %9s %9s %9s %8s\n", "offered", "achieved", "p50(ms)", "p99(ms)", "max(ms)", "dropped");
+    for (double rps = config.sweepStart; rps <= config.sweepEnd; rps += config.sweepStep) {
+        run(rps, NULL, &r);
+
+        double achieved = r.total.count / r.elapsed;
+        uint64_t p99 = hist_percentile(&r.total, 99);
+        if (baselineP99 == 0)
+            baselineP99 = p99;
+
+        printf("%10.1f %10.1f %9.3f %9.3f %9.3f %8llu\n", rps, achieved, hist_percentile(&r.total, 50) / 1e6,
+                p99 / 1e6, r.total.maxNs / 1e6, (unsigned long long)r.dropped);
+
+        if (saturation == 0 && (r.dropped > 0 || achieved < rps * 0.95 || p99 > baselineP99 * 10)) {
+            saturation = rps;
+            break;
+        }
+    }
+
+    if (saturation > 0)
+        printf("saturation point: ~%.1f req/s\n", saturation);
+    else
+        printf("no saturation observed up to %.1f req/s\n", config.sweepEnd);
+}
+
+static int parse_mix(char *spec)
+{
+    memset(config.mix, 0, sizeof(config.mix));
+
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (!eq)
+            return -1;
+        *eq = '\0';
+
+        int op = parse_op(tok);
+        if (op < 0)
+            return -1;
+        config.mix[op] = (unsigned)strtoul(eq + 1, NULL, 10);
+    }
+
+    unsigned total = 0;
+    for (int i = 0; i < OP_COUNT; ++i)
+        total += config.mix[i];
+    return total > 0 ? 0 : -1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -m MIX          operation mix, e.g. user-name=40,user-id=20,group-name=20,group-id=20,\n"
+            "                  list-users=0,list-groups=0\n"
+            "  -H RATIO        fraction of lookups for existing entries (default 0.9)\n"
+            "  -c N            number of concurrent workers (default 8)\n"
+            "  -r RPS          offered request rate (default 100)\n"
+            "  -d SECONDS      run duration (default 10)\n"
+            "  -t FILE         replay a recorded trace instead of generating requests, one\n"
+            "                  \"<timestamp-seconds> <op> <key> <hit|miss>\" per line\n"
+            "  -S SPEED        trace replay speed factor (default 1.0)\n"
+            "  -s START:END:STEP  sweep the request rate to find the saturation point, not combined with -t\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:H:c:r:d:t:S:s:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (parse_mix(optarg) < 0) {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                config.hitRatio = atof(optarg);
+                break;
+            case 'c':
+                config.concurrency = (unsigned)atoi(optarg);
+                break;
+            case 'r':
+                config.rps = atof(optarg);
+                break;
+            case 'd':
+                config.duration = atof(optarg);
+                break;
+            case 't':
+                config.tracePath = optarg;
+                break;
+            case 'S':
+                config.speed = atof(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%lf:%lf:%lf", &config.sweepStart, &config.sweepEnd, &config.sweepStep) != 3 ||
+                        config.sweepStart <= 0 || config.sweepStep <= 0) {
+                    fprintf(stderr, "Invalid sweep: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                config.sweep = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (config.concurrency == 0 || config.rps <= 0 || config.duration <= 0 || config.speed <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (config.sweep && config.tracePath) {
+        fprintf(stderr, "A trace cannot be replayed in a sweep, -t and -s are exclusive\n");
+        return EXIT_FAILURE;
+    }
+
+    load_keys();
+
+    if (config.sweep) {
+        run_sweep();
+        return EXIT_SUCCESS;
+    }
+
+    RunResult result;
+    FILE *trace = NULL;
+    if (config.tracePath) {
+        trace = fopen(config.tracePath, "r");
+        if (!trace) {
+            fprintf(stderr, "Failed to open trace %s: %s\n", config.tracePath, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    int ret = run(config.rps, trace, &result);
+    if (trace)
+        fclose(trace);
+
+    print_result(&result);
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
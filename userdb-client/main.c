@@ -1,6 +1,7 @@
 #include "client.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 int main(void)
 {
@@ -40,4 +41,18 @@ int main(void)
             s++;
         }
     }
+
+    printf("[CLIENT] SearchUsers prefix=com_example_, one per page\n");
+    char *cursor = NULL;
+    do {
+        char *next = NULL;
+        char **page = search_users("com_example_", 1, cursor, NULL, &next);
+        for (s = page; s && *s != NULL; s++) {
+            printf("[CLIENT] - %s\n", *s);
+            free(*s);
+        }
+        free(page);
+        free(cursor);
+        cursor = next;
+    } while (cursor);
 }
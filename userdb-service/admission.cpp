@@ -0,0 +1,159 @@
+#include "admission.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <glibmm.h>
+
+static constexpr double PRUNE_INTERVAL = 10.0;
+
+static double monotonicSeconds()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+TokenBucket::TokenBucket(double rate, double burst) :
+        m_rate(rate),
+        m_burst(burst),
+        m_tokens(burst),
+        m_last(monotonicSeconds())
+{
+}
+
+bool TokenBucket::consume(double now)
+{
+    // A bucket created after now was sampled must not lose tokens
+    m_tokens = std::min(m_burst, m_tokens + std::max(0.0, now - m_last) * m_rate);
+    m_last = std::max(m_last, now);
+
+    if (m_tokens < 1.0)
+        return false;
+
+    m_tokens -= 1.0;
+    return true;
+}
+
+bool TokenBucket::full(double now) const
+{
+    return m_tokens + (now - m_last) * m_rate >= m_burst;
+}
+
+AdmissionController::AdmissionController(const Config &config) :
+        m_config(config)
+{
+}
+
+AdmissionController::~AdmissionController()
+{
+    m_idle.disconnect();
+}
+
+unsigned long long AdmissionController::rateKey(const PeerId &peer, bool perProcess)
+{
+    auto key = static_cast<unsigned long long>(static_cast<unsigned int>(peer.uid)) << 32;
+    return perProcess ? key | static_cast<unsigned int>(peer.pid) : key;
+}
+
+// Takes a token from the bucket of the key for the class, creating the buckets with the given limits
+bool AdmissionController::consume(
+        unsigned long long key, const Limits &login, const Limits &bulk, RequestClass cls, double now)
+{
+    auto it = m_peers.find(key);
+    if (it == m_peers.end()) {
+        PeerState state {{login.rate, login.burst}, {bulk.rate, bulk.burst}};
+        it = m_peers.emplace(key, state).first;
+    }
+
+    auto &bucket = cls == RequestClass::Login ? it->second.login : it->second.bulk;
+    return bucket.consume(now);
+}
+
+bool AdmissionController::submit(const PeerId &peer, RequestClass cls, Task task)
+{
+    double now = monotonicSeconds();
+    auto &queue = cls == RequestClass::Login ? m_login : m_bulk;
+
+    auto pending = queue.perConnection.find(peer.connection);
+    std::size_t queued = pending == queue.perConnection.end() ? 0 : pending->second.size();
+
+    if (queued >= m_config.maxQueuedPerConnection)
+        return false;
+
+    if (m_config.exemptUids.count(peer.uid) == 0) {
+        // The process share is taken first, so that a process over it cannot drain the budget of its uid
+        if (m_config.perProcessUids.count(peer.uid) &&
+                !consume(rateKey(peer, true), m_config.processLogin, m_config.processBulk, cls, now))
+            return false;
+        if (!consume(rateKey(peer, false), m_config.login, m_config.bulk, cls, now))
+            return false;
+    }
+
+    if (queued == 0) {
+        pending = queue.perConnection.emplace(peer.connection, std::deque<Task> {}).first;
+        queue.ready.push_back(peer.connection);
+    }
+    pending->second.push_back(std::move(task));
+
+    if (!m_idle.connected())
+        m_idle = Glib::signal_idle().connect(sigc::mem_fun(*this, &AdmissionController::run));
+
+    if (now - m_lastPrune > PRUNE_INTERVAL)
+        prune(now);
+
+    return true;
+}
+
+void AdmissionController::forgetConnection(const void *connection)
+{
+    for (auto *queue : {&m_login, &m_bulk}) {
+        queue->perConnection.erase(connection);
+        queue->ready.erase(std::remove(queue->ready.begin(), queue->ready.end(), connection), queue->ready.end());
+    }
+}
+
+bool AdmissionController::runOne(ClassQueue &queue)
+{
+    if (queue.ready.empty())
+        return false;
+
+    const void *connection = queue.ready.front();
+    queue.ready.pop_front();
+
+    auto it = queue.perConnection.find(connection);
+    Task task = std::move(it->second.front());
+    it->second.pop_front();
+
+    if (it->second.empty())
+        queue.perConnection.erase(it);
+    else
+        queue.ready.push_back(connection);
+
+    task();
+    return true;
+}
+
+bool AdmissionController::run()
+{
+    for (std::size_t n = 0; n + 1 < m_config.batchSize; ++n) {
+        if (!runOne(m_login) && !runOne(m_bulk))
+            break;
+    }
+    runOne(m_bulk);
+
+    // Returning false removes the idle source until the next submit()
+    return !m_login.ready.empty() || !m_bulk.ready.empty();
+}
+
+// Forgets peers that have been idle long enough to have their buckets refilled, so that short-lived clients do not
+// accumulate state
+void AdmissionController::prune(double now)
+{
+    for (auto it = m_peers.begin(); it != m_peers.end();) {
+        if (it->second.login.full(now) && it->second.bulk.full(now))
+            it = m_peers.erase(it);
+        else
+            ++it;
+    }
+    m_lastPrune = now;
+}
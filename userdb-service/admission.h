@@ -0,0 +1,124 @@
+#ifndef USERDB_ADMISSION_H_
+#define USERDB_ADMISSION_H_
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/types.h>
+
+#include <sigc++/sigc++.h>
+
+enum class RequestClass
+{
+    // Lookups on the login path: users, groups and membership by key, and searches bounded by a limit
+    Login,
+    // Enumeration of whole tables
+    Bulk,
+};
+
+struct PeerId
+{
+    // Connection the request arrived on, used for fair queuing
+    const void *connection;
+    // Credentials of the peer, used for rate limiting; the pid only for uids limited per process
+    uid_t uid;
+    pid_t pid;
+};
+
+class TokenBucket
+{
+public:
+    TokenBucket(double rate, double burst);
+
+    // Refills the bucket up to now and takes one token if there is one
+    bool consume(double now);
+
+    bool full(double now) const;
+
+private:
+    double m_rate;
+    double m_burst;
+    double m_tokens;
+    double m_last;
+};
+
+// Rate limits requests per peer uid, or per process for the configured uids, and serves admitted requests round-robin
+// across connections, login lookups before bulk enumeration. Rejection is immediate so that a throttled peer costs no
+// more than a map lookup.
+class AdmissionController
+{
+public:
+    struct Limits
+    {
+        double rate;
+        double burst;
+    };
+
+    struct Config
+    {
+        Limits login {200, 400};
+        Limits bulk {5, 10};
+        // Peers never rate limited, such as a load generator; they are still queued fairly
+        std::unordered_set<uid_t> exemptUids;
+        // Peers whose processes each get a share of the budget of their uid, so that one busy daemon running as root
+        // does not use up the budget of every other root process. Short-lived processes still draw from the uid.
+        std::unordered_set<uid_t> perProcessUids {0};
+        // Budget of each process of the uids above
+        Limits processLogin {100, 200};
+        Limits processBulk {2, 5};
+        // Requests a single connection may have queued before new ones are rejected
+        std::size_t maxQueuedPerConnection = 64;
+        // Requests served per main loop iteration; one slot is reserved for bulk requests so they are not starved
+        std::size_t batchSize = 16;
+    };
+
+    using Task = std::function<void()>;
+
+    explicit AdmissionController(const Config &config);
+    ~AdmissionController();
+
+    // Queues the task for execution, or returns false if the peer is over its limits
+    bool submit(const PeerId &peer, RequestClass cls, Task task);
+
+    // Drops requests still queued for a closed connection
+    void forgetConnection(const void *connection);
+
+    bool idle() const
+    {
+        return m_login.ready.empty() && m_bulk.ready.empty();
+    }
+
+private:
+    struct PeerState
+    {
+        TokenBucket login;
+        TokenBucket bulk;
+    };
+
+    struct ClassQueue
+    {
+        std::unordered_map<const void *, std::deque<Task>> perConnection;
+        // Connections with queued tasks, in round-robin order
+        std::deque<const void *> ready;
+    };
+
+    bool run();
+    bool runOne(ClassQueue &queue);
+    void prune(double now);
+
+    static unsigned long long rateKey(const PeerId &peer, bool perProcess);
+    bool consume(unsigned long long key, const Limits &login, const Limits &bulk, RequestClass cls, double now);
+
+    Config m_config;
+    // Buckets by uid, and by uid and pid for peers limited per process
+    std::unordered_map<unsigned long long, PeerState> m_peers;
+    ClassQueue m_login;
+    ClassQueue m_bulk;
+    sigc::connection m_idle;
+    double m_lastPrune = 0;
+};
+
+#endif
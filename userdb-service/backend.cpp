@@ -0,0 +1,471 @@
+#include "backend.h"
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_set>
+
+#include <glibmm.h>
+
+#include "handoff.h"
+#include "userdb_trace.h"
+
+void Backend::lookupGroup(const LookupKey &, Callback<GroupInfo> callback)
+{
+    callback(std::nullopt);
+}
+
+void Backend::lookupUser(const LookupKey &, Callback<UserRecord> callback)
+{
+    callback(std::nullopt);
+}
+
+void Backend::lookupMemberships(const std::string &, uint64_t, GidsCallback callback)
+{
+    callback({});
+}
+
+void Backend::listGroups(NamesCallback callback)
+{
+    callback({});
+}
+
+void Backend::listUsers(NamesCallback callback)
+{
+    callback({});
+}
+
+void Backend::save(SnapshotWriter &) const
+{
+}
+
+bool Backend::load(SnapshotReader &)
+{
+    return true;
+}
+
+BlockingExecutor::BlockingExecutor(unsigned threads)
+{
+    for (unsigned i = 0; i < threads; ++i)
+        m_threads.emplace_back(&BlockingExecutor::loop, this);
+}
+
+BlockingExecutor::~BlockingExecutor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+
+    for (auto &thread : m_threads)
+        thread.join();
+}
+
+void BlockingExecutor::run(Work work)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(std::move(work));
+    }
+    m_wakeup.notify_one();
+}
+
+void BlockingExecutor::loop()
+{
+    for (;;) {
+        Work work;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+            if (m_stop)
+                return;
+
+            work = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+
+        // The work and its completion hold the callback chain of a call, whose destructors must run on the main
+        // context. Both are handed over by pointer: the slot passed to invoke() is copied, and the copy left on this
+        // thread may outlive the one run by the main loop.
+        auto *completion = new Completion([done = work(), work = std::move(work)]() { done(); });
+        Glib::MainContext::get_default()->invoke([completion]() {
+            (*completion)();
+            delete completion;
+            return false;
+        });
+    }
+}
+
+static std::string cacheKey(const LookupKey &key)
+{
+    return key.name.empty() ? "#" + std::to_string(key.id) : key.name;
+}
+
+CachingBackend::CachingBackend(
+        std::unique_ptr<Backend> backend, std::chrono::milliseconds ttl, std::chrono::milliseconds timeout) :
+        m_backend(std::move(backend)),
+        m_ttl(ttl),
+        m_timeout(timeout)
+{
+}
+
+const char *CachingBackend::name() const
+{
+    return m_backend->name();
+}
+
+bool CachingBackend::authoritative() const
+{
+    return m_backend->authoritative();
+}
+
+template <typename Result>
+std::function<void(Result)> CachingBackend::withDeadline(
+        std::function<void(Result)> callback, std::function<void(const Result &)> store) const
+{
+    struct State
+    {
+        bool done = false;
+        std::function<void(Result)> callback;
+        sigc::connection timer;
+    };
+
+    auto state = std::make_shared<State>();
+    state->callback = std::move(callback);
+
+    const char *backend = name();
+    state->timer = Glib::signal_timeout().connect(
+            [state, backend]() {
+                if (!state->done) {
+                    std::cerr << "[SERVICE] Backend " << backend << " timed out" << std::endl;
+                    state->done = true;
+                    state->callback(Result {});
+                }
+                return false;
+            },
+            m_timeout.count());
+
+    return [state, store = std::move(store)](Result result) {
+        // A late answer is still worth caching for the next lookup
+        if (store)
+            store(result);
+        if (state->done)
+            return;
+        state->done = true;
+        state->timer.disconnect();
+        state->callback(std::move(result));
+    };
+}
+
+void CachingBackend::storeGroup(const LookupKey &key, const std::optional<GroupInfo> &group)
+{
+    auto expires = std::chrono::steady_clock::now() + m_ttl;
+
+    m_groups[cacheKey(key)] = {group, expires};
+    if (group) {
+        m_groups[group->name] = {group, expires};
+        m_groups["#" + std::to_string(group->gid)] = {group, expires};
+    }
+}
+
+void CachingBackend::lookupGroup(const LookupKey &key, Callback<GroupInfo> callback)
+{
+    auto it = m_groups.find(cacheKey(key));
+    if (it != m_groups.end() && it->second.expires > std::chrono::steady_clock::now()) {
+        USERDB_TRACE(userdb_service, cache_hit, key.requestId, it->first.c_str());
+        callback(it->second.value);
+        return;
+    }
+    USERDB_TRACE(userdb_service, cache_miss, key.requestId, cacheKey(key).c_str());
+
+    m_backend->lookupGroup(key,
+            withDeadline<std::optional<GroupInfo>>(
+                    std::move(callback), [this, key](const auto &group) { storeGroup(key, group); }));
+}
+
+void CachingBackend::lookupUser(const LookupKey &key, Callback<UserRecord> callback)
+{
+    auto it = m_users.find(cacheKey(key));
+    if (it != m_users.end() && it->second.expires > std::chrono::steady_clock::now()) {
+        USERDB_TRACE(userdb_service, cache_hit, key.requestId, it->first.c_str());
+        callback(it->second.value);
+        return;
+    }
+    USERDB_TRACE(userdb_service, cache_miss, key.requestId, cacheKey(key).c_str());
+
+    m_backend->lookupUser(key,
+            withDeadline<std::optional<UserRecord>>(std::move(callback), [this, key](const auto &user) {
+                m_users[cacheKey(key)] = {user, std::chrono::steady_clock::now() + m_ttl};
+            }));
+}
+
+void CachingBackend::lookupMemberships(const std::string &user, uint64_t requestId, GidsCallback callback)
+{
+    auto it = m_memberships.find(user);
+    if (it != m_memberships.end() && it->second.expires > std::chrono::steady_clock::now()) {
+        callback(it->second.value);
+        return;
+    }
+
+    m_backend->lookupMemberships(user, requestId,
+            withDeadline<std::vector<gid_t>>(std::move(callback), [this, user](const auto &gids) {
+                m_memberships[user] = {gids, std::chrono::steady_clock::now() + m_ttl};
+            }));
+}
+
+void CachingBackend::listGroups(NamesCallback callback)
+{
+    m_backend->listGroups(withDeadline<std::vector<std::string>>(std::move(callback)));
+}
+
+void CachingBackend::listUsers(NamesCallback callback)
+{
+    m_backend->listUsers(withDeadline<std::vector<std::string>>(std::move(callback)));
+}
+
+// Only positive group entries are worth handing over: they are the ones that cost a slow lookup
+void CachingBackend::save(SnapshotWriter &writer) const
+{
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+
+    std::vector<const std::pair<const std::string, Entry<std::optional<GroupInfo>>> *> entries;
+    for (const auto &entry : m_groups) {
+        if (entry.second.value && entry.second.expires > now)
+            entries.push_back(&entry);
+    }
+
+    writer.putU32(entries.size());
+    for (const auto *entry : entries) {
+        const auto &group = entry->second.value.value();
+        writer.putString(entry->first);
+        writer.putString(group.name);
+        writer.putU32(group.gid);
+        writer.putU32(duration_cast<milliseconds>(entry->second.expires - now).count());
+        writer.putU32(group.members.size());
+        for (const auto &member : group.members)
+            writer.putString(member);
+    }
+}
+
+bool CachingBackend::load(SnapshotReader &reader)
+{
+    auto now = std::chrono::steady_clock::now();
+    uint32_t count = 0;
+
+    if (!reader.getU32(&count))
+        return false;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string key;
+        GroupInfo group;
+        uint32_t gid, ttlMs, memberCount;
+
+        if (!reader.getString(&key) || !reader.getString(&group.name) || !reader.getU32(&gid) ||
+                !reader.getU32(&ttlMs) || !reader.getU32(&memberCount))
+            return false;
+
+        group.gid = gid;
+        group.members.resize(memberCount);
+        for (auto &member : group.members) {
+            if (!reader.getString(&member))
+                return false;
+        }
+
+        m_groups[key] = {std::move(group), now + std::chrono::milliseconds(ttlMs)};
+    }
+
+    return true;
+}
+
+void BackendSet::add(std::unique_ptr<Backend> backend)
+{
+    m_backends.push_back(std::move(backend));
+}
+
+// Starts the same request on every backend and merges the answers once the last one completed
+template <typename Result, typename Merged>
+static void fanOut(const std::vector<std::unique_ptr<Backend>> &backends,
+        const std::function<void(Backend &, std::function<void(Result)>)> &start,
+        std::function<Merged(std::vector<Result> &)> merge, std::function<void(Merged)> done)
+{
+    struct State
+    {
+        std::vector<Result> results;
+        std::size_t pending;
+        std::function<Merged(std::vector<Result> &)> merge;
+        std::function<void(Merged)> done;
+    };
+
+    auto state = std::make_shared<State>();
+    state->results.resize(backends.size());
+    state->pending = backends.size();
+    state->merge = std::move(merge);
+    state->done = std::move(done);
+
+    if (backends.empty()) {
+        state->done(state->merge(state->results));
+        return;
+    }
+
+    for (std::size_t i = 0; i < backends.size(); ++i) {
+        start(*backends[i], [state, i](Result result) {
+            state->results[i] = std::move(result);
+            if (--state->pending == 0)
+                state->done(state->merge(state->results));
+        });
+    }
+}
+
+template <typename T>
+static void appendUnique(std::vector<T> &to, std::unordered_set<T> &seen, const std::vector<T> &from)
+{
+    for (const auto &item : from) {
+        if (seen.insert(item).second)
+            to.push_back(item);
+    }
+}
+
+void BackendSet::lookupGroup(const LookupKey &key, Backend::Callback<GroupInfo> callback)
+{
+    using Result = std::optional<GroupInfo>;
+    const auto &backends = m_backends;
+
+    fanOut<Result, Result>(
+            m_backends,
+            [key](Backend &backend, std::function<void(Result)> done) { backend.lookupGroup(key, std::move(done)); },
+            [&backends](std::vector<Result> &results) -> Result {
+                Result merged;
+                for (std::size_t i = 0; i < results.size() && !merged; ++i) {
+                    if (results[i] && backends[i]->authoritative())
+                        merged = GroupInfo {results[i]->name, results[i]->gid, {}};
+                }
+                if (!merged)
+                    return std::nullopt;
+
+                std::unordered_set<std::string> seen;
+                for (const auto &result : results) {
+                    if (result && result->gid == merged->gid)
+                        appendUnique(merged->members, seen, result->members);
+                }
+                return merged;
+            },
+            std::move(callback));
+}
+
+void BackendSet::lookupUser(const LookupKey &key, Backend::Callback<UserRecord> callback)
+{
+    using Result = std::optional<UserRecord>;
+    const auto &backends = m_backends;
+
+    fanOut<Result, Result>(
+            m_backends,
+            [key](Backend &backend, std::function<void(Result)> done) { backend.lookupUser(key, std::move(done)); },
+            [&backends](std::vector<Result> &results) -> Result {
+                for (std::size_t i = 0; i < results.size(); ++i) {
+                    if (results[i] && backends[i]->authoritative())
+                        return results[i];
+                }
+                return std::nullopt;
+            },
+            std::move(callback));
+}
+
+void BackendSet::lookupMemberships(const std::string &user, uint64_t requestId, Backend::GidsCallback callback)
+{
+    using Result = std::vector<gid_t>;
+
+    fanOut<Result, Result>(
+            m_backends,
+            [user, requestId](Backend &backend, std::function<void(Result)> done) {
+                backend.lookupMemberships(user, requestId, std::move(done));
+            },
+            [](std::vector<Result> &results) {
+                Result merged;
+                std::unordered_set<gid_t> seen;
+                for (const auto &result : results)
+                    appendUnique(merged, seen, result);
+                return merged;
+            },
+            std::move(callback));
+}
+
+static std::vector<std::string> mergeNames(std::vector<std::vector<std::string>> &results)
+{
+    std::vector<std::string> merged;
+    std::unordered_set<std::string> seen;
+    for (const auto &result : results)
+        appendUnique(merged, seen, result);
+    return merged;
+}
+
+void BackendSet::listGroups(Backend::NamesCallback callback)
+{
+    using Result = std::vector<std::string>;
+
+    fanOut<Result, Result>(
+            m_backends,
+            [](Backend &backend, std::function<void(Result)> done) { backend.listGroups(std::move(done)); },
+            mergeNames, std::move(callback));
+}
+
+void BackendSet::listUsers(Backend::NamesCallback callback)
+{
+    using Result = std::vector<std::string>;
+
+    fanOut<Result, Result>(
+            m_backends,
+            [](Backend &backend, std::function<void(Result)> done) { backend.listUsers(std::move(done)); },
+            mergeNames, std::move(callback));
+}
+
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+// The state of each backend is stored as a separate blob, so that a backend that was added, removed or changed its
+// format between two versions does not prevent the others from loading theirs
+std::string BackendSet::save() const
+{
+    SnapshotWriter writer;
+
+    writer.putU32(SNAPSHOT_VERSION);
+    writer.putU32(m_backends.size());
+    for (const auto &backend : m_backends) {
+        SnapshotWriter state;
+        backend->save(state);
+        writer.putString(backend->name());
+        writer.putString(state.data());
+    }
+
+    return writer.data();
+}
+
+void BackendSet::load(const std::string &snapshot)
+{
+    SnapshotReader reader(snapshot);
+    uint32_t version = 0;
+    uint32_t count = 0;
+
+    if (!reader.getU32(&version) || version != SNAPSHOT_VERSION || !reader.getU32(&count)) {
+        std::cerr << "[SERVICE] Ignoring incompatible snapshot" << std::endl;
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string name, data;
+        if (!reader.getString(&name) || !reader.getString(&data)) {
+            std::cerr << "[SERVICE] Truncated snapshot" << std::endl;
+            return;
+        }
+
+        auto it = std::find_if(m_backends.begin(), m_backends.end(),
+                [&](const auto &backend) { return name == backend->name(); });
+        if (it == m_backends.end())
+            continue;
+
+        SnapshotReader state(data);
+        if (!(*it)->load(state))
+            std::cerr << "[SERVICE] Failed to restore state of backend " << name << std::endl;
+        else
+            std::cout << "[SERVICE] Restored state of backend " << name << std::endl;
+    }
+}
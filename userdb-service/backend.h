@@ -0,0 +1,178 @@
+#ifndef USERDB_BACKEND_H_
+#define USERDB_BACKEND_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+class SnapshotReader;
+class SnapshotWriter;
+
+struct GroupRecord
+{
+    std::string name;
+    gid_t gid;
+};
+
+struct UserRecord
+{
+    std::string name;
+    uid_t uid;
+    gid_t gid;
+};
+
+struct GroupInfo
+{
+    std::string name;
+    gid_t gid = 0;
+    std::vector<std::string> members;
+};
+
+// Key of a lookup: by name if the name is not empty, by id otherwise
+struct LookupKey
+{
+    std::string name;
+    uint32_t id = 0;
+    // Id of the method call the lookup is made for, reported by tracepoints
+    uint64_t requestId = 0;
+
+    bool matches(const std::string &recordName, uint32_t recordId) const
+    {
+        return name.empty() ? recordId == id : recordName == name;
+    }
+};
+
+// A source of user and group records.
+//
+// Every lookup completes exactly once by invoking its callback on the main loop, possibly before the call returns.
+// Backends that need to block must do so on a BlockingExecutor. A backend that does not know the answer completes
+// with an empty result.
+class Backend
+{
+public:
+    template <typename T>
+    using Callback = std::function<void(std::optional<T>)>;
+    using NamesCallback = std::function<void(std::vector<std::string>)>;
+    using GidsCallback = std::function<void(std::vector<gid_t>)>;
+
+    virtual ~Backend() = default;
+
+    virtual const char *name() const = 0;
+
+    // Records of non-authoritative backends only extend the membership of groups found by authoritative ones
+    virtual bool authoritative() const
+    {
+        return true;
+    }
+
+    virtual void lookupGroup(const LookupKey &key, Callback<GroupInfo> callback);
+    virtual void lookupUser(const LookupKey &key, Callback<UserRecord> callback);
+    // Groups listing the user as a member
+    virtual void lookupMemberships(const std::string &user, uint64_t requestId, GidsCallback callback);
+    virtual void listGroups(NamesCallback callback);
+    virtual void listUsers(NamesCallback callback);
+
+    // Warm state handed over to a new instance on hot restart
+    virtual void save(SnapshotWriter &writer) const;
+    virtual bool load(SnapshotReader &reader);
+};
+
+// Runs blocking calls on worker threads and delivers their completions on the main loop
+class BlockingExecutor
+{
+public:
+    using Completion = std::function<void()>;
+    using Work = std::function<Completion()>;
+
+    explicit BlockingExecutor(unsigned threads);
+    ~BlockingExecutor();
+
+    void run(Work work);
+
+private:
+    void loop();
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::deque<Work> m_queue;
+    bool m_stop = false;
+    std::vector<std::thread> m_threads;
+};
+
+// Adds result caching and a deadline to another backend. Negative results are cached too, so that lookups of
+// unknown names do not reach a slow source every time. A lookup that misses the deadline completes empty and its
+// late result is dropped.
+class CachingBackend : public Backend
+{
+public:
+    CachingBackend(std::unique_ptr<Backend> backend, std::chrono::milliseconds ttl, std::chrono::milliseconds timeout);
+
+    const char *name() const override;
+    bool authoritative() const override;
+
+    void lookupGroup(const LookupKey &key, Callback<GroupInfo> callback) override;
+    void lookupUser(const LookupKey &key, Callback<UserRecord> callback) override;
+    void lookupMemberships(const std::string &user, uint64_t requestId, GidsCallback callback) override;
+    void listGroups(NamesCallback callback) override;
+    void listUsers(NamesCallback callback) override;
+
+    void save(SnapshotWriter &writer) const override;
+    bool load(SnapshotReader &reader) override;
+
+private:
+    template <typename T>
+    struct Entry
+    {
+        T value;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    // Bounds the wait for the backend by m_timeout, answering with an empty result when it is late. Only an answer of
+    // the backend itself is passed to store, so that timeouts are not cached.
+    template <typename Result>
+    std::function<void(Result)> withDeadline(
+            std::function<void(Result)> callback, std::function<void(const Result &)> store = nullptr) const;
+
+    void storeGroup(const LookupKey &key, const std::optional<GroupInfo> &group);
+
+    std::unique_ptr<Backend> m_backend;
+    std::chrono::milliseconds m_ttl;
+    std::chrono::milliseconds m_timeout;
+    // Keyed by name, or by "#<id>" for lookups by id
+    std::unordered_map<std::string, Entry<std::optional<GroupInfo>>> m_groups;
+    std::unordered_map<std::string, Entry<std::optional<UserRecord>>> m_users;
+    std::unordered_map<std::string, Entry<std::vector<gid_t>>> m_memberships;
+};
+
+// Queries all backends in parallel and merges their answers: the record comes from the first authoritative backend
+// (in registration order) that knows it, group members and listings are the union of all answers.
+class BackendSet
+{
+public:
+    void add(std::unique_ptr<Backend> backend);
+
+    void lookupGroup(const LookupKey &key, Backend::Callback<GroupInfo> callback);
+    void lookupUser(const LookupKey &key, Backend::Callback<UserRecord> callback);
+    void lookupMemberships(const std::string &user, uint64_t requestId, Backend::GidsCallback callback);
+    void listGroups(Backend::NamesCallback callback);
+    void listUsers(Backend::NamesCallback callback);
+
+    std::string save() const;
+    void load(const std::string &snapshot);
+
+private:
+    std::vector<std::unique_ptr<Backend>> m_backends;
+};
+
+#endif
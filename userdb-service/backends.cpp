@@ -0,0 +1,385 @@
+#include "backends.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include <grp.h>
+#include <sys/stat.h>
+
+#include "userdb_trace.h"
+
+// Static configuration of groups to be extended. May be also generated in runtime
+// FIXME: get group ID dynamically
+static const std::vector<GroupRecord> extendedGroups = {{"service-client", 1001}};
+
+static const std::vector<UserRecord> dynamicUsers = {
+        {"com_example_dynamicuser", 100000, 100000},
+        {"com_example_dynamicuser2", 100001, 100001},
+};
+
+static bool fileExists(const char *filename)
+{
+    FILE *file = NULL;
+    if ((file = fopen(filename, "r")) == NULL) {
+        return false;
+    }
+    else {
+        fclose(file);
+    }
+
+    return true;
+}
+
+void StaticBackend::lookupGroup(const LookupKey &key, Callback<GroupInfo> callback)
+{
+    auto it = std::find_if(
+            dynamicUsers.begin(), dynamicUsers.end(), [&](const auto &i) { return key.matches(i.name, i.gid); });
+    if (it == dynamicUsers.end()) {
+        callback(std::nullopt);
+        return;
+    }
+
+    USERDB_TRACE(userdb_service, internal_hit, key.requestId, it->name.c_str());
+    callback(GroupInfo {it->name, it->gid, {}});
+}
+
+void StaticBackend::lookupUser(const LookupKey &key, Callback<UserRecord> callback)
+{
+    auto it = std::find_if(
+            dynamicUsers.begin(), dynamicUsers.end(), [&](const auto &i) { return key.matches(i.name, i.uid); });
+    if (it == dynamicUsers.end()) {
+        callback(std::nullopt);
+        return;
+    }
+
+    callback(*it);
+}
+
+void StaticBackend::listGroups(NamesCallback callback)
+{
+    listUsers(std::move(callback));
+}
+
+void StaticBackend::listUsers(NamesCallback callback)
+{
+    std::vector<std::string> names;
+    for (const auto &s : dynamicUsers)
+        names.push_back(s.name);
+    callback(std::move(names));
+}
+
+SystemGroupBackend::SystemGroupBackend(BlockingExecutor &executor) :
+        m_executor(executor)
+{
+}
+
+// Runs on an executor thread
+static std::optional<GroupInfo> getSystemGroup(const LookupKey &key)
+{
+    struct group gr = {};
+    struct group *grp;
+    char buf[2048];
+    int ret = -1;
+
+    USERDB_TRACE(userdb_service, group_fallback_entry, key.requestId, key.name.c_str());
+    if (key.name.empty())
+        ret = getgrgid_r(key.id, &gr, buf, sizeof(buf), &grp);
+    else
+        ret = getgrnam_r(key.name.c_str(), &gr, buf, sizeof(buf), &grp);
+    USERDB_TRACE(userdb_service, group_fallback_return, key.requestId, ret);
+
+    if (ret != 0 || grp == NULL)
+        return std::nullopt;
+
+    GroupInfo group {gr.gr_name, gr.gr_gid, {}};
+    for (char **p = &gr.gr_mem[0]; *p != NULL; ++p) {
+        group.members.push_back(*p);
+    }
+    return group;
+}
+
+void SystemGroupBackend::lookupGroup(const LookupKey &key, Callback<GroupInfo> callback)
+{
+    auto ext = std::find_if(
+            extendedGroups.begin(), extendedGroups.end(), [&](const auto &i) { return key.matches(i.name, i.gid); });
+    if (ext == extendedGroups.end()) {
+        callback(std::nullopt);
+        return;
+    }
+
+    m_executor.run([key, callback]() -> BlockingExecutor::Completion {
+        auto group = getSystemGroup(key);
+        return [group, callback]() { callback(group); };
+    });
+}
+
+void SystemGroupBackend::lookupMemberships(const std::string &user, uint64_t requestId, GidsCallback callback)
+{
+    m_executor.run([user, requestId, callback]() -> BlockingExecutor::Completion {
+        std::vector<gid_t> gids;
+        for (const auto &ext : extendedGroups) {
+            auto group = getSystemGroup({ext.name, 0, requestId});
+            if (group && std::find(group->members.begin(), group->members.end(), user) != group->members.end())
+                gids.push_back(group->gid);
+        }
+        return [gids, callback]() { callback(gids); };
+    });
+}
+
+void SystemGroupBackend::listGroups(NamesCallback callback)
+{
+    std::vector<std::string> names;
+    for (const auto &s : extendedGroups)
+        names.push_back(s.name);
+    callback(std::move(names));
+}
+
+#define DYNAMIC_GROUP_FLAG_FILE "/tmp/enable-dynamic-group"
+
+static const GroupRecord dynamicGroup = {"service-client", 1001};
+static const char *dynamicMember = "com_example_dynamicuser";
+
+// Extend the membership dynamically depending on system state
+void DynamicMembershipBackend::lookupGroup(const LookupKey &key, Callback<GroupInfo> callback)
+{
+    if (!key.matches(dynamicGroup.name, dynamicGroup.gid) || !fileExists(DYNAMIC_GROUP_FLAG_FILE)) {
+        callback(std::nullopt);
+        return;
+    }
+
+    callback(GroupInfo {dynamicGroup.name, dynamicGroup.gid, {dynamicMember}});
+}
+
+void DynamicMembershipBackend::lookupMemberships(const std::string &user, uint64_t, GidsCallback callback)
+{
+    if (user != dynamicMember || !fileExists(DYNAMIC_GROUP_FLAG_FILE)) {
+        callback({});
+        return;
+    }
+
+    callback({dynamicGroup.gid});
+}
+
+FileBackend::FileBackend(std::string groupPath, std::string passwdPath) :
+        m_groupPath(std::move(groupPath)),
+        m_passwdPath(std::move(passwdPath))
+{
+}
+
+static std::vector<std::string> splitFields(const std::string &line, char separator)
+{
+    std::vector<std::string> fields;
+    std::istringstream stream(line);
+    std::string field;
+
+    while (std::getline(stream, field, separator))
+        fields.push_back(field);
+    if (!line.empty() && line.back() == separator)
+        fields.emplace_back();
+    return fields;
+}
+
+static bool parseId(const std::string &text, uint32_t *id)
+{
+    char *end = nullptr;
+    unsigned long value = strtoul(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || value > UINT32_MAX)
+        return false;
+    *id = value;
+    return true;
+}
+
+static std::time_t modificationTime(const std::string &path)
+{
+    struct stat s;
+    return stat(path.c_str(), &s) == 0 ? s.st_mtime : 0;
+}
+
+// Applies the difference between the loaded groups and the new ones to the nesting index, so that a change to one
+// group only updates the groups containing it. Members named "@<group>" are nested groups.
+void FileBackend::updateNesting(const std::vector<GroupInfo> &groups)
+{
+    std::unordered_map<std::string, std::set<std::string>> oldMembers, newMembers;
+    for (const auto &group : m_groups)
+        oldMembers[group.name].insert(group.members.begin(), group.members.end());
+    for (const auto &group : groups)
+        newMembers[group.name].insert(group.members.begin(), group.members.end());
+
+    auto apply = [this](const std::string &group, const std::string &member, bool add) {
+        bool nested = member[0] == '@';
+        if (nested && !add)
+            m_nesting.removeNesting(group, member.substr(1));
+        else if (nested && !m_nesting.addNesting(group, member.substr(1)))
+            std::cerr << "[SERVICE] Postponing nesting of " << member.substr(1) << " in " << group
+                      << " until it no longer creates a cycle" << std::endl;
+        else if (!nested && add)
+            m_nesting.addUser(group, member);
+        else if (!nested)
+            m_nesting.removeUser(group, member);
+    };
+
+    // Removals first, so that moving a group within the hierarchy is not taken for a cycle
+    for (const auto &[group, members] : oldMembers) {
+        auto updated = newMembers.find(group);
+        if (updated == newMembers.end()) {
+            m_nesting.removeGroup(group);
+            continue;
+        }
+        for (const auto &member : members) {
+            if (!updated->second.count(member))
+                apply(group, member, false);
+        }
+    }
+
+    for (const auto &[group, members] : newMembers) {
+        auto previous = oldMembers.find(group);
+        for (const auto &member : members) {
+            if (previous == oldMembers.end() || !previous->second.count(member))
+                apply(group, member, true);
+        }
+    }
+}
+
+// Checks the files at most once per second, so that a burst of lookups does not stat them on every call
+void FileBackend::refresh()
+{
+    std::time_t now = std::time(nullptr);
+    if (now == m_lastCheck)
+        return;
+    m_lastCheck = now;
+
+    std::time_t groupMtime = modificationTime(m_groupPath);
+    if (groupMtime != m_groupMtime) {
+        m_groupMtime = groupMtime;
+
+        std::vector<GroupInfo> groups;
+        std::ifstream file(m_groupPath);
+        std::string line;
+        while (std::getline(file, line)) {
+            auto fields = splitFields(line, ':');
+            uint32_t gid;
+            if (line.empty() || line[0] == '#' || fields.size() != 4 || !parseId(fields[2], &gid))
+                continue;
+
+            GroupInfo group {fields[0], gid, {}};
+            for (auto &member : splitFields(fields[3], ',')) {
+                if (!member.empty())
+                    group.members.push_back(std::move(member));
+            }
+            groups.push_back(std::move(group));
+        }
+
+        updateNesting(groups);
+        m_groups = std::move(groups);
+        m_groupsByName.clear();
+        m_groupsById.clear();
+        for (std::size_t i = 0; i < m_groups.size(); ++i) {
+            m_groupsByName.emplace(m_groups[i].name, i);
+            m_groupsById.emplace(m_groups[i].gid, i);
+        }
+    }
+
+    std::time_t passwdMtime = modificationTime(m_passwdPath);
+    if (passwdMtime != m_passwdMtime) {
+        m_passwdMtime = passwdMtime;
+        m_users.clear();
+
+        std::ifstream file(m_passwdPath);
+        std::string line;
+        while (std::getline(file, line)) {
+            auto fields = splitFields(line, ':');
+            uint32_t uid, gid;
+            if (line.empty() || line[0] == '#' || fields.size() != 7 || !parseId(fields[2], &uid) ||
+                    !parseId(fields[3], &gid))
+                continue;
+
+            m_users.push_back({fields[0], uid, gid});
+        }
+
+        m_usersByName.clear();
+        m_usersById.clear();
+        for (std::size_t i = 0; i < m_users.size(); ++i) {
+            m_usersByName.emplace(m_users[i].name, i);
+            m_usersById.emplace(m_users[i].uid, i);
+        }
+    }
+}
+
+// Position of the record with the key's name, or id if the key has no name
+template <typename Id>
+static std::optional<std::size_t> findRecord(const LookupKey &key,
+        const std::unordered_map<std::string, std::size_t> &byName, const std::unordered_map<Id, std::size_t> &byId)
+{
+    if (key.name.empty()) {
+        auto it = byId.find(key.id);
+        return it == byId.end() ? std::nullopt : std::optional<std::size_t>(it->second);
+    }
+    auto it = byName.find(key.name);
+    return it == byName.end() ? std::nullopt : std::optional<std::size_t>(it->second);
+}
+
+void FileBackend::lookupGroup(const LookupKey &key, Callback<GroupInfo> callback)
+{
+    refresh();
+
+    auto pos = findRecord(key, m_groupsByName, m_groupsById);
+    if (!pos) {
+        callback(std::nullopt);
+        return;
+    }
+
+    const auto &group = m_groups[*pos];
+    callback(GroupInfo {group.name, group.gid, m_nesting.effectiveMembers(group.name)});
+}
+
+void FileBackend::lookupUser(const LookupKey &key, Callback<UserRecord> callback)
+{
+    refresh();
+
+    auto pos = findRecord(key, m_usersByName, m_usersById);
+    if (!pos) {
+        callback(std::nullopt);
+        return;
+    }
+
+    callback(m_users[*pos]);
+}
+
+void FileBackend::lookupMemberships(const std::string &user, uint64_t, GidsCallback callback)
+{
+    refresh();
+
+    std::vector<gid_t> gids;
+    for (const auto &group : m_nesting.groupsOf(user)) {
+        auto it = m_groupsByName.find(group);
+        if (it != m_groupsByName.end())
+            gids.push_back(m_groups[it->second].gid);
+    }
+    callback(std::move(gids));
+}
+
+void FileBackend::listGroups(NamesCallback callback)
+{
+    refresh();
+
+    std::vector<std::string> names;
+    for (const auto &group : m_groups)
+        names.push_back(group.name);
+    callback(std::move(names));
+}
+
+void FileBackend::listUsers(NamesCallback callback)
+{
+    refresh();
+
+    std::vector<std::string> names;
+    for (const auto &user : m_users)
+        names.push_back(user.name);
+    callback(std::move(names));
+}
@@ -0,0 +1,106 @@
+#ifndef USERDB_BACKENDS_H_
+#define USERDB_BACKENDS_H_
+
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "backend.h"
+#include "nesting.h"
+
+// Users with a private group of the same name and id, from a static table
+class StaticBackend : public Backend
+{
+public:
+    const char *name() const override
+    {
+        return "static";
+    }
+
+    void lookupGroup(const LookupKey &key, Callback<GroupInfo> callback) override;
+    void lookupUser(const LookupKey &key, Callback<UserRecord> callback) override;
+    void listGroups(NamesCallback callback) override;
+    void listUsers(NamesCallback callback) override;
+};
+
+// System groups extended with the users of this service, resolved through getgrnam_r/getgrgid_r. Only groups of an
+// allow-list are served. The calls may block on NSS modules such as sssd, so they run on the executor.
+class SystemGroupBackend : public Backend
+{
+public:
+    explicit SystemGroupBackend(BlockingExecutor &executor);
+
+    const char *name() const override
+    {
+        return "system-groups";
+    }
+
+    void lookupGroup(const LookupKey &key, Callback<GroupInfo> callback) override;
+    void lookupMemberships(const std::string &user, uint64_t requestId, GidsCallback callback) override;
+    void listGroups(NamesCallback callback) override;
+
+private:
+    BlockingExecutor &m_executor;
+};
+
+// Adds members to groups found by other backends depending on system state
+class DynamicMembershipBackend : public Backend
+{
+public:
+    const char *name() const override
+    {
+        return "dynamic-membership";
+    }
+
+    bool authoritative() const override
+    {
+        return false;
+    }
+
+    void lookupGroup(const LookupKey &key, Callback<GroupInfo> callback) override;
+    void lookupMemberships(const std::string &user, uint64_t requestId, GidsCallback callback) override;
+};
+
+// Local database in group(5) and passwd(5) format. The files are small and local, so they are read on the main loop
+// and only reloaded when their modification time changes. Missing files are treated as empty.
+//
+// A group member written as "@<group>" nests that group: lookups return the effective members of the whole nesting
+// and memberships include every group containing the user at any depth.
+class FileBackend : public Backend
+{
+public:
+    FileBackend(std::string groupPath, std::string passwdPath);
+
+    const char *name() const override
+    {
+        return "files";
+    }
+
+    void lookupGroup(const LookupKey &key, Callback<GroupInfo> callback) override;
+    void lookupUser(const LookupKey &key, Callback<UserRecord> callback) override;
+    void lookupMemberships(const std::string &user, uint64_t requestId, GidsCallback callback) override;
+    void listGroups(NamesCallback callback) override;
+    void listUsers(NamesCallback callback) override;
+
+private:
+    void refresh();
+    void updateNesting(const std::vector<GroupInfo> &groups);
+
+    std::string m_groupPath;
+    std::string m_passwdPath;
+    std::time_t m_groupMtime = 0;
+    std::time_t m_passwdMtime = 0;
+    std::time_t m_lastCheck = 0;
+    // Groups with their direct members as written in the file
+    std::vector<GroupInfo> m_groups;
+    // Positions in m_groups and m_users by name and by id; the first record wins if a file repeats one
+    std::unordered_map<std::string, std::size_t> m_groupsByName;
+    std::unordered_map<gid_t, std::size_t> m_groupsById;
+    GroupNesting m_nesting;
+    std::vector<UserRecord> m_users;
+    std::unordered_map<std::string, std::size_t> m_usersByName;
+    std::unordered_map<uid_t, std::size_t> m_usersById;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "handoff.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const char HANDOFF_ACK = 'A';
+
+static bool makeAddress(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+int listenUnixSocket(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat s;
+
+    if (!makeAddress(path, &addr))
+        return -1;
+
+    if (stat(path, &s) == 0 && S_ISSOCK(s.st_mode)) {
+        std::cerr << "File " << path << " exists, deleting it..." << std::endl;
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        std::cerr << "Failed to listen at " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int listenHandoff(const char *path)
+{
+    // Only the owner may connect: the socket file is created without write permission for others
+    mode_t mask = umask(077);
+    int fd = listenUnixSocket(path);
+    umask(mask);
+    return fd;
+}
+
+int sendHandoff(int handoffFd, int listenFd, const std::string &snapshot)
+{
+    int connFd = accept4(handoffFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connFd < 0) {
+        std::cerr << "Failed to accept handoff request: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    struct ucred cred = {};
+    socklen_t credLen = sizeof(cred);
+    if (getsockopt(connFd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) < 0 || cred.uid != getuid()) {
+        std::cerr << "Rejecting handoff request from uid " << cred.uid << std::endl;
+        close(connFd);
+        return -1;
+    }
+
+    int memFd = memfd_create("userdb-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memFd < 0) {
+        std::cerr << "Failed to create snapshot: " << strerror(errno) << std::endl;
+        close(connFd);
+        return -1;
+    }
+
+    if (write(memFd, snapshot.data(), snapshot.size()) != static_cast<ssize_t>(snapshot.size()) ||
+            fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        std::cerr << "Failed to write snapshot: " << strerror(errno) << std::endl;
+        close(memFd);
+        close(connFd);
+        return -1;
+    }
+
+    uint64_t size = snapshot.size();
+    struct iovec iov = {&size, sizeof(size)};
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control = {};
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = {listenFd, memFd};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent = sendmsg(connFd, &msg, MSG_NOSIGNAL);
+    close(memFd);
+
+    if (sent != sizeof(size)) {
+        std::cerr << "Failed to send handoff: " << strerror(errno) << std::endl;
+        close(connFd);
+        return -1;
+    }
+
+    return connFd;
+}
+
+bool receiveHandoffAck(int connFd)
+{
+    char ack = 0;
+    return read(connFd, &ack, 1) == 1 && ack == HANDOFF_ACK;
+}
+
+int requestHandoff(const char *path, std::string *snapshot, int *ackFd)
+{
+    struct sockaddr_un addr;
+    if (!makeAddress(path, &addr))
+        return -1;
+
+    int connFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connFd < 0)
+        return -1;
+
+    if (connect(connFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "No running instance to take over from: " << strerror(errno) << std::endl;
+        close(connFd);
+        return -1;
+    }
+
+    uint64_t size = 0;
+    struct iovec iov = {&size, sizeof(size)};
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control = {};
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int fds[2] = {-1, -1};
+    ssize_t received = recvmsg(connFd, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (received == sizeof(size) && cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    if (fds[0] < 0 || fds[1] < 0) {
+        std::cerr << "Malformed handoff message" << std::endl;
+        close(connFd);
+        return -1;
+    }
+
+    snapshot->resize(size);
+    if (pread(fds[1], &(*snapshot)[0], size, 0) != static_cast<ssize_t>(size)) {
+        std::cerr << "Failed to read snapshot, starting cold" << std::endl;
+        snapshot->clear();
+    }
+    close(fds[1]);
+
+    *ackFd = connFd;
+    return fds[0];
+}
+
+bool sendHandoffAck(int ackFd)
+{
+    bool sent = write(ackFd, &HANDOFF_ACK, 1) == 1;
+    if (!sent)
+        std::cerr << "Failed to acknowledge handoff: " << strerror(errno) << std::endl;
+    close(ackFd);
+    return sent;
+}
+
+void SnapshotWriter::putU32(uint32_t value)
+{
+    m_data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void SnapshotWriter::putString(const std::string &value)
+{
+    putU32(value.size());
+    m_data.append(value);
+}
+
+SnapshotReader::SnapshotReader(const std::string &data) :
+        m_data(data)
+{
+}
+
+bool SnapshotReader::getU32(uint32_t *value)
+{
+    if (m_data.size() - m_pos < sizeof(*value))
+        return false;
+
+    memcpy(value, m_data.data() + m_pos, sizeof(*value));
+    m_pos += sizeof(*value);
+    return true;
+}
+
+bool SnapshotReader::getString(std::string *value)
+{
+    uint32_t size;
+    if (!getU32(&size) || m_data.size() - m_pos < size)
+        return false;
+
+    value->assign(m_data, m_pos, size);
+    m_pos += size;
+    return true;
+}
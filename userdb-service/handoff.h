@@ -0,0 +1,66 @@
+#ifndef USERDB_HANDOFF_H_
+#define USERDB_HANDOFF_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Hot restart support.
+//
+// A running service listens on a control socket next to the D-Bus socket. A new instance started with --hot-restart
+// connects to it and receives, through SCM_RIGHTS, the listening D-Bus socket and a sealed memfd holding a snapshot
+// of the warm in-memory state. Once the new instance serves the socket it acknowledges the handoff, and the old one
+// stops accepting connections, drains the requests in flight and exits. Until then the old instance keeps serving,
+// also if the new one fails to start. The D-Bus socket is never closed, so clients never see a failed connect.
+// Connections to the old instance are closed once it exits, and a call racing with the close fails.
+
+// Creates the listening socket at path for a cold start, replacing a stale socket file. Returns the fd or -1.
+int listenUnixSocket(const char *path);
+
+// Listens for handoff requests at path. Only processes running as the same uid are served. Returns the fd or -1.
+int listenHandoff(const char *path);
+
+// Old instance: accepts a handoff request and sends the listening socket and the snapshot. Returns the connection
+// to the new instance, which becomes readable once the new instance acknowledged the handoff, or -1.
+int sendHandoff(int handoffFd, int listenFd, const std::string &snapshot);
+
+// Old instance: checks the acknowledgment read from the connection returned by sendHandoff()
+bool receiveHandoffAck(int connFd);
+
+// New instance: fetches the listening socket and the snapshot from a running instance. Returns the listening socket,
+// and in ackFd the connection to acknowledge the handoff on, or -1 if no instance is running.
+int requestHandoff(const char *path, std::string *snapshot, int *ackFd);
+
+// New instance: tells the old one it serves the listening socket, so that the old one may drain and exit. Closes
+// ackFd; closing it without acknowledging, e.g. by exiting, leaves the old instance serving.
+bool sendHandoffAck(int ackFd);
+
+class SnapshotWriter
+{
+public:
+    void putU32(uint32_t value);
+    void putString(const std::string &value);
+
+    const std::string &data() const
+    {
+        return m_data;
+    }
+
+private:
+    std::string m_data;
+};
+
+class SnapshotReader
+{
+public:
+    explicit SnapshotReader(const std::string &data);
+
+    bool getU32(uint32_t *value);
+    bool getString(std::string *value);
+
+private:
+    const std::string &m_data;
+    std::size_t m_pos = 0;
+};
+
+#endif
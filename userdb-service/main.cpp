@@ -1,264 +1,689 @@
-#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <optional>
 #include <string>
-#include <tuple>
+#include <unordered_set>
 #include <vector>
 
-#include <grp.h>
-#include <pwd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <giomm/unixfdlist.h>
+
+#include "admission.h"
+#include "backend.h"
+#include "backends.h"
+#include "handoff.h"
+#include "name_blob.h"
+#include "name_index.h"
 #include "userdb_common.h"
+#include "userdb_marshal.h"
 #include "userdb_stub.h"
+#define USERDB_TRACE_SEMAPHORES
+#include "userdb_trace.h"
 
-struct GroupRecord
-{
-    std::string name;
-    gid_t gid;
-};
+USERDB_TRACE_SEMAPHORE(userdb_service, method_entry);
+USERDB_TRACE_SEMAPHORE(userdb_service, method_return);
 
-struct UserRecord
+// One method call from the moment it is served until its reply is sent. Emits method_entry/method_return
+// tracepoints, see userdb_trace.h, and counts the call as in flight.
+class MethodCall
 {
-    std::string name;
-    uid_t uid;
-    gid_t gid;
-};
-
-// Static configuration of groups to be extended. May be also generated in runtime
-// FIXME: get group ID dynamically
-static const std::vector<GroupRecord> extendedGroups = {{"service-client", 1001}};
-
-static const std::vector<UserRecord> dynamicUsers = {
-        {"com_example_dynamicuser", 100000, 100000},
-        {"com_example_dynamicuser2", 100001, 100001},
-};
+public:
+    MethodCall(const char *method, ::com::example::UserDbStub::MethodInvocation &msg, std::size_t &inFlight) :
+            m_method(method),
+            m_id(++s_lastId),
+            m_inFlight(inFlight)
+    {
+        ++m_inFlight;
+
+        // The peer credentials are only looked up while a tracer is attached to the probe
+        if (USERDB_TRACE_ENABLED(userdb_service, method_entry)) {
+            auto invocation = msg.getMessage();
+            auto credentials = invocation->get_connection()->get_peer_credentials();
+            pid_t peerPid = credentials ? credentials->get_unix_pid() : -1;
+            guint32 serial = invocation->get_message()->get_serial();
+            USERDB_TRACE(userdb_service, method_entry, m_id, m_method, peerPid, serial);
+        }
+    }
 
-static bool fileExists(const char *filename)
-{
-    FILE *file = NULL;
-    if ((file = fopen(filename, "r")) == NULL) {
-        return false;
+    ~MethodCall()
+    {
+        USERDB_TRACE(userdb_service, method_return, m_id, m_method);
+        --m_inFlight;
     }
-    else {
-        fclose(file);
+
+    uint64_t id() const
+    {
+        return m_id;
     }
 
-    return true;
-}
+private:
+    const char *m_method;
+    uint64_t m_id;
+    std::size_t &m_inFlight;
+    static inline uint64_t s_lastId = 0;
+};
 
 class UserDb : public ::com::example::UserDbStub
 {
 private:
-    std::optional<std::tuple<std::string, gid_t, std::vector<std::string>>> getInternalGroup(
-            std::string name, gid_t gid)
+    struct SearchIndex
     {
-        auto it = std::find_if(dynamicUsers.begin(), dynamicUsers.end(), [=](const auto &i) {
-            if (name.empty())
-                return i.gid == gid;
-            return i.name == name;
-        });
-        if (it == dynamicUsers.end()) {
-            return std::nullopt;
-        }
+        NameIndex index;
+        std::chrono::steady_clock::time_point built;
+        bool ready = false;
+        bool building = false;
+        // Searches waiting for the first build
+        std::vector<std::function<void(const NameIndex &)>> waiting;
+    };
+
+    static constexpr std::chrono::seconds SEARCH_INDEX_TTL {30};
+    static constexpr std::size_t MAX_SEARCH_LIMIT = 1000;
+
+    std::shared_ptr<MethodCall> startCall(const char *method, MethodInvocation &msg)
+    {
+        return std::make_shared<MethodCall>(method, msg, m_inFlight);
+    }
 
-        return std::make_tuple(it->name, it->gid, std::vector<std::string> {});
+    // Out arguments of Method serialized in one pass by the generated marshaller, instead of boxing each of them
+    // into a Glib::Variant first
+    template <typename Method, typename... Args>
+    static Glib::VariantContainerBase marshal(const Args &...args)
+    {
+        std::size_t size = Method::outSize(args...);
+        void *data = g_malloc(size);
+        Method::outEncode(data, size, args...);
+        GVariant *value = g_variant_new_from_data(
+                reinterpret_cast<const GVariantType *>(Method::outType), data, size, TRUE, g_free, data);
+        return Glib::VariantContainerBase(g_variant_ref_sink(value));
     }
 
-    std::optional<std::tuple<std::string, gid_t, std::vector<std::string>>> getGroup(
-            std::string name, gid_t gid, MethodInvocation &msg)
+    template <typename Method, typename... Args>
+    static void reply(MethodInvocation &msg, const Args &...args)
     {
-        bool b = false;
-        auto t = getInternalGroup(name, gid);
-        if (t)
-            return t.value();
+        msg.getMessage()->return_value(marshal<Method>(args...));
+    }
 
-        if (std::find_if(extendedGroups.begin(), extendedGroups.end(), [=](const auto &i) {
-                if (name.empty())
-                    return i.gid == gid;
-                return i.name == name;
-            }) == extendedGroups.end()) {
-            msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Unknown group"));
-            return std::nullopt;
+    // Replies to one of the *Fd methods: the fixed out arguments followed by names, inline when they are small and
+    // in a sealed memfd otherwise
+    template <typename Method, typename... Args>
+    static void replyNames(MethodInvocation &msg, const std::vector<std::string> &names, const Args &...args)
+    {
+        if (!needsNameBlob(names)) {
+            reply<Method>(msg, args..., names, std::vector<gint32> {});
+            return;
         }
 
-        struct group gr = {};
-        struct group *grp;
-        char buf[2048];
-        int ret = -1;
+        int fd = writeNameBlob(names);
+        if (fd < 0) {
+            msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Failed to create the reply"));
+            return;
+        }
 
-        if (name.empty())
-            ret = getgrgid_r(gid, &gr, buf, sizeof(buf), &grp);
-        else
-            ret = getgrnam_r(name.c_str(), &gr, buf, sizeof(buf), &grp);
+        // The list keeps a duplicate of the fd until the reply is sent
+        auto fds = Gio::UnixFDList::create();
+        gint32 handle = fds->append(fd);
+        close(fd);
+        msg.getMessage()->return_value(
+                marshal<Method>(args..., std::vector<std::string> {}, std::vector<gint32> {handle}), fds);
+    }
 
-        if (ret < 0) {
-            msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Failed to get group by name"));
-            return std::nullopt;
+    static constexpr std::size_t MAX_PRINTED_MEMBERS = 16;
+
+    static void printMembers(const std::vector<std::string> &members)
+    {
+        for (std::size_t i = 0; i < members.size() && i < MAX_PRINTED_MEMBERS; ++i) {
+            std::cout << "# " << members[i] << ", ";
         }
+        if (members.size() > MAX_PRINTED_MEMBERS)
+            std::cout << "... " << members.size() << " members";
+        std::cout << std::endl;
+    }
 
-        name = gr.gr_name;
-        gid = gr.gr_gid;
+    // passFd selects the *Fd variant of the method, which may pass the members in a memfd
+    void serveGetGroupByName(const Glib::ustring &name, MethodInvocation &msg, bool passFd)
+    {
+        const char *method = passFd ? "GetGroupByNameFd" : "GetGroupByName";
+        auto call = startCall(method, msg);
+        std::cout << "[SERVICE] UserDb::" << method << ": name=" << name << std::endl;
+        m_backends.lookupGroup({name, 0, call->id()}, [call, msg, passFd](std::optional<GroupInfo> group) mutable {
+            if (!group) {
+                msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Unknown group"));
+                return;
+            }
+            printMembers(group->members);
+            if (passFd)
+                replyNames<userdb::marshal::GetGroupByNameFd>(msg, group->members, group->gid);
+            else
+                reply<userdb::marshal::GetGroupByName>(msg, group->gid, group->members);
+        });
+    }
 
-        std::vector<std::string> membership;
-        for (char **p = &gr.gr_mem[0]; *p != NULL; ++p) {
-            membership.push_back(*p);
-        }
+    void serveGetGroupById(guint32 gid, MethodInvocation &msg, bool passFd)
+    {
+        const char *method = passFd ? "GetGroupByIdFd" : "GetGroupById";
+        auto call = startCall(method, msg);
+        std::cout << "[SERVICE] UserDb::" << method << ": gid=" << gid << std::endl;
+        m_backends.lookupGroup({"", gid, call->id()}, [call, msg, passFd](std::optional<GroupInfo> group) mutable {
+            if (!group) {
+                msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Unknown group"));
+                return;
+            }
+            printMembers(group->members);
+            if (passFd)
+                replyNames<userdb::marshal::GetGroupByIdFd>(msg, group->members, group->name);
+            else
+                reply<userdb::marshal::GetGroupById>(msg, group->name, group->members);
+        });
+    }
 
-        // Extend the membership dynamically depending on system state
-        if (fileExists("/tmp/enable-dynamic-group") && name == "service-client") {
-            membership.push_back("com_example_dynamicuser");
-        }
+    void serveGetUserByName(const Glib::ustring &name, MethodInvocation &msg)
+    {
+        auto call = startCall("GetUserByName", msg);
+        std::cout << "[SERVICE] UserDb::GetUserByName: name=" << name << std::endl;
+        m_backends.lookupUser({name, 0, call->id()}, [call, msg](std::optional<UserRecord> user) mutable {
+            if (!user) {
+                msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Unknown user"));
+                return;
+            }
+            reply<userdb::marshal::GetUserByName>(msg, user->uid, user->gid);
+        });
+    }
+
+    // GetUserByName plus the primary group record and the supplementary gids, which NSS asks for right after
+    // getpwnam() during login. The group part is left empty if the primary group is unknown.
+    void serveGetUserByNameExpanded(const Glib::ustring &name, MethodInvocation &msg)
+    {
+        auto call = startCall("GetUserByNameExpanded", msg);
+        std::cout << "[SERVICE] UserDb::GetUserByNameExpanded: name=" << name << std::endl;
+        m_backends.lookupUser({name, 0, call->id()}, [this, call, msg](std::optional<UserRecord> user) mutable {
+            if (!user) {
+                msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Unknown user"));
+                return;
+            }
+
+            // The primary group and the memberships are looked up in parallel, the reply is sent by the last one
+            struct Expanded
+            {
+                UserRecord user;
+                MethodInvocation msg;
+                std::shared_ptr<MethodCall> call;
+                std::optional<GroupInfo> group;
+                std::vector<gid_t> gids;
+                int pending = 2;
+
+                void complete()
+                {
+                    if (--pending > 0)
+                        return;
+
+                    std::vector<guint32> supplementary;
+                    for (gid_t gid : gids) {
+                        if (gid != user.gid)
+                            supplementary.push_back(gid);
+                    }
+                    reply<userdb::marshal::GetUserByNameExpanded>(msg, user.uid, user.gid,
+                            group ? group->name : std::string(), group ? group->members : std::vector<std::string> {},
+                            supplementary);
+                }
+            };
+
+            auto expanded = std::make_shared<Expanded>(Expanded {*user, msg, call});
+            m_backends.lookupGroup({"", user->gid, call->id()}, [expanded](std::optional<GroupInfo> group) {
+                expanded->group = std::move(group);
+                expanded->complete();
+            });
+            m_backends.lookupMemberships(user->name, call->id(), [expanded](std::vector<gid_t> gids) {
+                expanded->gids = std::move(gids);
+                expanded->complete();
+            });
+        });
+    }
+
+    void serveGetUserById(guint32 uid, MethodInvocation &msg)
+    {
+        auto call = startCall("GetUserById", msg);
+        std::cout << "[SERVICE] UserDb::GetUserById: uid=" << uid << std::endl;
+        m_backends.lookupUser({"", uid, call->id()}, [call, msg](std::optional<UserRecord> user) mutable {
+            if (!user) {
+                msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Unknown user"));
+                return;
+            }
+            reply<userdb::marshal::GetUserById>(msg, user->name, user->gid);
+        });
+    }
+
+    void serveListGroups(MethodInvocation &msg, bool passFd)
+    {
+        const char *method = passFd ? "ListGroupsFd" : "ListGroups";
+        auto call = startCall(method, msg);
+        std::cout << "[SERVICE] UserDb::" << method << std::endl;
+        m_backends.listGroups([call, msg, method, passFd](std::vector<std::string> names) mutable {
+            std::cout << "[SERVICE] UserDb::" << method << ": " << names.size() << " groups" << std::endl;
+            if (passFd)
+                replyNames<userdb::marshal::ListGroupsFd>(msg, names);
+            else
+                reply<userdb::marshal::ListGroups>(msg, names);
+        });
+    }
 
-        return std::make_tuple(name, gid, membership);
+    void serveListUsers(MethodInvocation &msg, bool passFd)
+    {
+        const char *method = passFd ? "ListUsersFd" : "ListUsers";
+        auto call = startCall(method, msg);
+        std::cout << "[SERVICE] UserDb::" << method << std::endl;
+        m_backends.listUsers([call, msg, method, passFd](std::vector<std::string> names) mutable {
+            std::cout << "[SERVICE] UserDb::" << method << ": " << names.size() << " users" << std::endl;
+            if (passFd)
+                replyNames<userdb::marshal::ListUsersFd>(msg, names);
+            else
+                reply<userdb::marshal::ListUsers>(msg, names);
+        });
     }
 
-    std::optional<std::tuple<std::string, uid_t, gid_t>> getUser(std::string name, uid_t uid, MethodInvocation &msg)
+    // Calls back with the index, rebuilding it from the backends once it is older than SEARCH_INDEX_TTL. Only the
+    // searches made before the first build completed wait for it, later ones use the previous index meanwhile.
+    void withIndex(SearchIndex &index, void (BackendSet::*list)(Backend::NamesCallback),
+            std::function<void(const NameIndex &)> callback)
     {
-        auto it = std::find_if(dynamicUsers.begin(), dynamicUsers.end(), [=](const auto &i) {
-            if (name.empty())
-                return i.uid == uid;
-            return i.name == name;
+        auto now = std::chrono::steady_clock::now();
+        if (index.ready)
+            callback(index.index);
+        else
+            index.waiting.push_back(std::move(callback));
+
+        if (index.building || (index.ready && now - index.built < SEARCH_INDEX_TTL))
+            return;
+
+        index.building = true;
+        (m_backends.*list)([&index](std::vector<std::string> names) {
+            index.index = NameIndex(std::move(names));
+            index.built = std::chrono::steady_clock::now();
+            index.building = false;
+            index.ready = true;
+
+            std::vector<std::function<void(const NameIndex &)>> waiting;
+            waiting.swap(index.waiting);
+            for (auto &callback : waiting)
+                callback(index.index);
         });
+    }
 
-        if (it == dynamicUsers.end()) {
-            msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::FAILED, "Unknown user"));
-            return std::nullopt;
+    // Replies with one page of names starting with prefix. The cursor is the last name of the previous page, the
+    // reply carries the cursor of the next page or an empty one on the last page.
+    void serveSearch(const char *method, SearchIndex &index, void (BackendSet::*list)(Backend::NamesCallback),
+            const Glib::ustring &prefix, guint32 limit, const Glib::ustring &cursor, MethodInvocation &msg)
+    {
+        auto call = startCall(method, msg);
+        std::cout << "[SERVICE] UserDb::" << method << ": prefix=" << prefix << ", limit=" << limit << std::endl;
+
+        std::size_t count = limit == 0 || limit > MAX_SEARCH_LIMIT ? MAX_SEARCH_LIMIT : limit;
+        withIndex(index, list,
+                [call, msg, prefix = prefix.raw(), cursor = cursor.raw(), count](const NameIndex &names) mutable {
+                    bool more = false;
+                    auto page = names.search(prefix, cursor, count, &more);
+                    std::string next = more ? page.back() : "";
+                    // SearchUsers and SearchGroups replies have the same layout
+                    reply<userdb::marshal::SearchUsers>(msg, page, next);
+                });
+    }
+
+    // Runs the handler once the admission controller schedules it, or rejects the call right away
+    template <typename Handler>
+    void admit(MethodInvocation &msg, RequestClass cls, Handler &&handler)
+    {
+        auto connection = msg.getMessage()->get_connection();
+        auto credentials = connection->get_peer_credentials();
+        PeerId peer {connection->gobj(), static_cast<uid_t>(-1), -1};
+        if (credentials) {
+            peer.uid = credentials->get_unix_user();
+            peer.pid = credentials->get_unix_pid();
         }
 
-        return std::make_tuple(it->name, it->uid, it->gid);
+        if (!m_admission.submit(peer, cls, std::forward<Handler>(handler)))
+            msg.ret(Gio::DBus::Error(Gio::DBus::Error::Code::LIMITS_EXCEEDED, "Too many requests"));
     }
 
+    AdmissionController m_admission;
+    BackendSet m_backends;
+    // Calls being served whose reply has not been sent yet, waiting for a backend
+    std::size_t m_inFlight = 0;
+    SearchIndex m_userIndex;
+    SearchIndex m_groupIndex;
+
 public:
+    UserDb(const AdmissionController::Config &admissionConfig, BackendSet backends) :
+            m_admission(admissionConfig),
+            m_backends(std::move(backends))
+    {
+    }
+
+    void forgetConnection(const GDBusConnection *connection)
+    {
+        m_admission.forgetConnection(connection);
+    }
+
+    // No admitted request is waiting to be served or for its reply
+    bool idle() const
+    {
+        return m_admission.idle() && m_inFlight == 0;
+    }
+
+    std::string saveSnapshot() const
+    {
+        return m_backends.save();
+    }
+
+    void loadSnapshot(const std::string &snapshot)
+    {
+        m_backends.load(snapshot);
+    }
+
     void GetGroupByName(const Glib::ustring &name, MethodInvocation &msg) override
     {
-        std::cout << "[SERVICE] UserDb::GetGroupByName: name=" << name << std::endl;
-        auto o = getGroup(name, 0, msg);
-        if (!o) {
-            return;
-        }
-        auto t = o.value();
-        for (auto &i : std::get<2>(t)) {
-            std::cout << "# " << i << ", ";
-        }
-        std::cout << std::endl;
-        msg.ret(std::get<1>(t), ::com::example::UserDbTypeWrap::stdStringVecToGlibStringVec(std::get<2>(t)));
+        admit(msg, RequestClass::Login, [this, name, msg]() mutable { serveGetGroupByName(name, msg, false); });
+    }
+
+    void GetGroupByNameFd(const Glib::ustring &name, MethodInvocation &msg) override
+    {
+        admit(msg, RequestClass::Login, [this, name, msg]() mutable { serveGetGroupByName(name, msg, true); });
     }
 
     void GetGroupById(guint32 gid, MethodInvocation &msg) override
     {
-        std::cout << "[SERVICE] UserDb::GetGroupById: gid=" << gid << std::endl;
-        auto o = getGroup("", gid, msg);
-        if (!o)
-            return;
-        auto t = o.value();
-        for (auto &i : std::get<2>(t)) {
-            std::cout << "# " << i << ", ";
-        }
-        std::cout << std::endl;
-        msg.ret(std::get<0>(t), ::com::example::UserDbTypeWrap::stdStringVecToGlibStringVec(std::get<2>(t)));
+        admit(msg, RequestClass::Login, [this, gid, msg]() mutable { serveGetGroupById(gid, msg, false); });
+    }
+
+    void GetGroupByIdFd(guint32 gid, MethodInvocation &msg) override
+    {
+        admit(msg, RequestClass::Login, [this, gid, msg]() mutable { serveGetGroupById(gid, msg, true); });
     }
 
     void GetUserByName(const Glib::ustring &name, MethodInvocation &msg) override
     {
-        std::cout << "[SERVICE] UserDb::GetUserByName: name=" << name << std::endl;
-        auto o = getUser(name, 0, msg);
-        if (!o)
-            return;
-        auto t = o.value();
-        msg.ret(std::get<1>(t), std::get<2>(t));
+        admit(msg, RequestClass::Login, [this, name, msg]() mutable { serveGetUserByName(name, msg); });
+    }
+
+    void GetUserByNameExpanded(const Glib::ustring &name, MethodInvocation &msg) override
+    {
+        admit(msg, RequestClass::Login, [this, name, msg]() mutable { serveGetUserByNameExpanded(name, msg); });
     }
 
     void GetUserById(guint32 uid, MethodInvocation &msg) override
     {
-        std::cout << "[SERVICE] UserDb::GetUserById: uid=" << uid << std::endl;
-        auto o = getUser("", uid, msg);
-        if (!o)
-            return;
-        auto t = o.value();
-        msg.ret(std::get<0>(t), std::get<2>(t));
+        admit(msg, RequestClass::Login, [this, uid, msg]() mutable { serveGetUserById(uid, msg); });
     }
 
     void ListGroups(MethodInvocation &msg) override
     {
-        std::cout << "[SERVICE] UserDb::ListGroups" << std::endl;
-        std::vector<std::string> names;
-        for (const auto &s : dynamicUsers) {
-            std::cout << "[SERVICE] - " << s.name << std::endl;
-            names.push_back(s.name);
-        }
+        admit(msg, RequestClass::Bulk, [this, msg]() mutable { serveListGroups(msg, false); });
+    }
 
-        for (const auto &s : extendedGroups) {
-            std::cout << "[SERVICE] - " << s.name << std::endl;
-            names.push_back(s.name);
-        }
-        msg.ret(::com::example::UserDbTypeWrap::stdStringVecToGlibStringVec(names));
+    void ListGroupsFd(MethodInvocation &msg) override
+    {
+        admit(msg, RequestClass::Bulk, [this, msg]() mutable { serveListGroups(msg, true); });
     }
 
     void ListUsers(MethodInvocation &msg) override
     {
-        std::cout << "[SERVICE] UserDb::ListUsers" << std::endl;
-        std::vector<std::string> names;
-        for (const auto &s : dynamicUsers) {
-            std::cout << "[SERVICE] - " << s.name << std::endl;
-            names.push_back(s.name);
-        }
-        msg.ret(::com::example::UserDbTypeWrap::stdStringVecToGlibStringVec(names));
+        admit(msg, RequestClass::Bulk, [this, msg]() mutable { serveListUsers(msg, false); });
+    }
+
+    void ListUsersFd(MethodInvocation &msg) override
+    {
+        admit(msg, RequestClass::Bulk, [this, msg]() mutable { serveListUsers(msg, true); });
+    }
+
+    void SearchUsers(const Glib::ustring &prefix, guint32 limit, const Glib::ustring &cursor,
+            MethodInvocation &msg) override
+    {
+        admit(msg, RequestClass::Login, [this, prefix, limit, cursor, msg]() mutable {
+            serveSearch("SearchUsers", m_userIndex, &BackendSet::listUsers, prefix, limit, cursor, msg);
+        });
+    }
+
+    void SearchGroups(const Glib::ustring &prefix, guint32 limit, const Glib::ustring &cursor,
+            MethodInvocation &msg) override
+    {
+        admit(msg, RequestClass::Login, [this, prefix, limit, cursor, msg]() mutable {
+            serveSearch("SearchGroups", m_groupIndex, &BackendSet::listGroups, prefix, limit, cursor, msg);
+        });
     }
 };
 
 #define UNIX_SOCKET_FILE_NAME "/tmp/user-db.sock"
 #define DEFAULT_BUS_PATH "unix:path=" UNIX_SOCKET_FILE_NAME
+#define HANDOFF_SOCKET_FILE_NAME UNIX_SOCKET_FILE_NAME ".handoff"
+
+// How long a replaced instance keeps serving connections that are still open before it exits
+static constexpr std::chrono::seconds DRAIN_TIMEOUT {5};
+
+// Slow backends are cached and bounded by a deadline, so that one stuck source cannot stall every lookup. System
+// groups may be resolved through sssd or LDAP, which is too slow to repeat for each of the several lookups of a login;
+// their membership rarely changes, and 30 s is how long a change may go unnoticed, as with the search index.
+static constexpr std::chrono::seconds BACKEND_CACHE_TTL {30};
+static constexpr std::chrono::seconds BACKEND_TIMEOUT {2};
+
+// Reads a number of requests per second from the environment, keeping the default if unset or invalid
+static void readLimit(const char *name, double &value)
+{
+    const char *text = getenv(name);
+    if (!text)
+        return;
+
+    char *end = nullptr;
+    double parsed = strtod(text, &end);
+    if (end == text || *end != '\0' || !(parsed > 0)) {
+        std::cerr << "Ignoring invalid " << name << "=" << text << "." << std::endl;
+        return;
+    }
+    value = parsed;
+}
+
+// Reads a comma separated list of uids from the environment, keeping the default if unset or invalid
+static void readUids(const char *name, std::unordered_set<uid_t> &uids)
+{
+    const char *text = getenv(name);
+    if (!text)
+        return;
+
+    std::unordered_set<uid_t> parsed;
+    for (const char *p = text; *p;) {
+        char *end = nullptr;
+        unsigned long uid = strtoul(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0')) {
+            std::cerr << "Ignoring invalid " << name << "=" << text << "." << std::endl;
+            return;
+        }
+        parsed.insert(static_cast<uid_t>(uid));
+        p = *end ? end + 1 : end;
+    }
+    uids = std::move(parsed);
+}
+
+// Admission limits may be tuned through the environment, which a hot restart started from the same unit inherits
+static AdmissionController::Config admissionConfig()
+{
+    AdmissionController::Config config;
+    readLimit("USERDB_LOGIN_RATE", config.login.rate);
+    readLimit("USERDB_LOGIN_BURST", config.login.burst);
+    readLimit("USERDB_BULK_RATE", config.bulk.rate);
+    readLimit("USERDB_BULK_BURST", config.bulk.burst);
+    readLimit("USERDB_PROCESS_LOGIN_RATE", config.processLogin.rate);
+    readLimit("USERDB_PROCESS_LOGIN_BURST", config.processLogin.burst);
+    readLimit("USERDB_PROCESS_BULK_RATE", config.processBulk.rate);
+    readLimit("USERDB_PROCESS_BULK_BURST", config.processBulk.burst);
+    readUids("USERDB_EXEMPT_UIDS", config.exemptUids);
+    readUids("USERDB_PER_PROCESS_UIDS", config.perProcessUids);
+    return config;
+}
+
+// Backends in order of precedence
+static BackendSet createBackends(BlockingExecutor &executor)
+{
+    BackendSet backends;
+    backends.add(std::make_unique<StaticBackend>());
+    backends.add(std::make_unique<CachingBackend>(
+            std::make_unique<SystemGroupBackend>(executor), BACKEND_CACHE_TTL, BACKEND_TIMEOUT));
+    backends.add(std::make_unique<FileBackend>("/etc/userdb/group", "/etc/userdb/passwd"));
+    backends.add(std::make_unique<DynamicMembershipBackend>());
+    return backends;
+}
 
 // Check that service is running:
 // dbus-send --peer=unix:path=/tmp/user-db.sock --print-reply /com/example/UserDb com.example.UserDb.ListGroups
-int main(void)
+//
+// Upgrade by starting the new binary with --hot-restart while the old one is running: it takes over the listening
+// socket and the warm caches, and the old instance exits once it has drained. Connections are never refused, but
+// connections still open after DRAIN_TIMEOUT are closed, see README.md.
+int main(int argc, char **argv)
 {
     Glib::init();
     Gio::init();
 
     const char *objectPath = "/com/example/UserDb";
-    struct stat s;
+    bool hotRestart = argc > 1 && strcmp(argv[1], "--hot-restart") == 0;
+
+    // Instantiate and run the main loop
+    Glib::RefPtr<Glib::MainLoop> ml = Glib::MainLoop::create();
 
-    int r = stat(UNIX_SOCKET_FILE_NAME, &s);
-    if (r == 0 && S_ISSOCK(s.st_mode)) {
-        std::cerr << "File " << UNIX_SOCKET_FILE_NAME << " exists, deleting it..." << std::endl;
-        unlink(UNIX_SOCKET_FILE_NAME);
+    // Declared before userDb, whose backends post to it
+    BlockingExecutor executor {4};
+    UserDb userDb {admissionConfig(), createBackends(executor)};
+
+    int listenFd = -1;
+    // Acknowledged once this instance serves the socket; the running instance serves it until then
+    int handoffAckFd = -1;
+    if (hotRestart) {
+        std::string snapshot;
+        listenFd = requestHandoff(HANDOFF_SOCKET_FILE_NAME, &snapshot, &handoffAckFd);
+        if (listenFd >= 0) {
+            std::cout << "Received listening socket from the running instance." << std::endl;
+            userDb.loadSnapshot(snapshot);
+        }
     }
 
+    // Created before the umask change, so that only the service user can take over
+    int handoffFd = listenHandoff(HANDOFF_SOCKET_FILE_NAME);
+
     // Set umask 0 to allow everybody to exchange messages with D-Bus serviceF
     umask(0);
 
-    // Instantiate and run the main loop
-    Glib::RefPtr<Glib::MainLoop> ml = Glib::MainLoop::create();
+    if (listenFd < 0)
+        listenFd = listenUnixSocket(UNIX_SOCKET_FILE_NAME);
+    if (listenFd < 0)
+        return EXIT_FAILURE;
 
-    UserDb userDb;
-    Glib::RefPtr<Gio::DBus::Server> server;
+    // Accept and authenticate connections by hand instead of using Gio::DBus::Server, which cannot adopt an existing
+    // listening socket
+    const std::string guid = Gio::DBus::generate_guid();
+    std::map<GDBusConnection *, Glib::RefPtr<Gio::DBus::Connection>> connections;
+    Glib::RefPtr<Gio::SocketService> service = Gio::SocketService::create();
 
     try {
-        server = Gio::DBus::Server::create_sync(DEFAULT_BUS_PATH, Gio::DBus::generate_guid());
+        service->add_socket(Gio::Socket::create_from_fd(listenFd));
     }
     catch (const Glib::Error &ex) {
         std::cerr << "Error creating server at address: " << DEFAULT_BUS_PATH << ": " << ex.what() << "." << std::endl;
         return EXIT_FAILURE;
     }
 
-    server->start();
-
-    std::cout << "Server is listening at: " << server->get_client_address() << "." << std::endl;
-
-    server->signal_new_connection().connect(
-            [&](const Glib::RefPtr<Gio::DBus::Connection> &connection) {
-                g_print("Connected to bus.\n");
-                if (userDb.register_object(connection, objectPath) == 0) {
-                    fprintf(stderr, "!!!\n");
-                    return false;
-                }
+    service->signal_incoming().connect(
+            [&](const Glib::RefPtr<Gio::SocketConnection> &stream, const Glib::RefPtr<Glib::Object> &) {
+                Gio::DBus::Connection::create(
+                        stream, guid,
+                        [&](Glib::RefPtr<Gio::AsyncResult> &result) {
+                            Glib::RefPtr<Gio::DBus::Connection> connection;
+                            try {
+                                connection = Gio::DBus::Connection::create_finish(result);
+                            }
+                            catch (const Glib::Error &ex) {
+                                std::cerr << "Failed to authenticate client: " << ex.what() << "." << std::endl;
+                                return;
+                            }
+
+                            g_print("Connected to bus.\n");
+                            GDBusConnection *key = connection->gobj();
+                            connections[key] = connection;
+                            connection->signal_closed().connect([&, key](bool, const Glib::Error &) {
+                                userDb.forgetConnection(key);
+                                connections.erase(key);
+                            });
+
+                            if (userDb.register_object(connection, objectPath) == 0) {
+                                fprintf(stderr, "!!!\n");
+                                connections.erase(key);
+                                return;
+                            }
+                            connection->start_message_processing();
+                        },
+                        Gio::DBus::CONNECTION_FLAGS_AUTHENTICATION_SERVER |
+                                Gio::DBus::CONNECTION_FLAGS_DELAY_MESSAGE_PROCESSING);
                 return true;
-            },
-            false);
+            });
+
+    service->start();
+
+    std::cout << "Server is listening at: " << DEFAULT_BUS_PATH << "." << std::endl;
+
+    if (handoffAckFd >= 0 && sendHandoffAck(handoffAckFd))
+        std::cout << "Took over from the running instance." << std::endl;
+
+    // Stops accepting connections and exits once the requests in flight are served
+    auto drain = [&]() {
+        auto deadline = std::chrono::steady_clock::now() + DRAIN_TIMEOUT;
+
+        service->stop();
+        service->close();
+
+        Glib::signal_timeout().connect(
+                [&, deadline]() {
+                    if (userDb.idle() && (connections.empty() || std::chrono::steady_clock::now() > deadline)) {
+                        ml->quit();
+                        return false;
+                    }
+                    return true;
+                },
+                100);
+    };
+
+    sigc::connection handoffWatch;
+    if (handoffFd >= 0) {
+        handoffWatch = Glib::signal_io().connect(
+                [&](Glib::IOCondition) {
+                    int connFd = sendHandoff(handoffFd, listenFd, userDb.saveSnapshot());
+                    if (connFd < 0)
+                        return true;
+
+                    // Keep serving until the new instance confirms it serves the socket. If it fails to start, the
+                    // connection is closed unacknowledged.
+                    Glib::signal_io().connect(
+                            [&, connFd](Glib::IOCondition) {
+                                bool acked = receiveHandoffAck(connFd);
+                                close(connFd);
+                                if (!acked) {
+                                    std::cerr << "Handoff was not acknowledged, keep serving." << std::endl;
+                                    return false;
+                                }
+
+                                std::cout << "Handed over to the new instance, draining." << std::endl;
+                                handoffWatch.disconnect();
+                                close(handoffFd);
+                                drain();
+                                return false;
+                            },
+                            connFd, Glib::IO_IN | Glib::IO_HUP);
+                    return true;
+                },
+                handoffFd, Glib::IO_IN);
+    }
 
     ml->run();
 
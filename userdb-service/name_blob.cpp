@@ -0,0 +1,77 @@
+#include "name_blob.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "userdb_blob.h"
+
+static std::size_t stringsSize(const std::vector<std::string> &names)
+{
+    std::size_t size = 0;
+    for (auto &name : names)
+        size += name.size() + 1;
+    return size;
+}
+
+bool needsNameBlob(const std::vector<std::string> &names)
+{
+    return stringsSize(names) + names.size() * sizeof(uint32_t) > USERDB_BLOB_THRESHOLD;
+}
+
+int writeNameBlob(const std::vector<std::string> &names)
+{
+    std::size_t strings = stringsSize(names);
+    if (strings > std::numeric_limits<uint32_t>::max() || names.size() > std::numeric_limits<uint32_t>::max()) {
+        std::cerr << "Name list too large: " << names.size() << " names" << std::endl;
+        return -1;
+    }
+
+    UserDbBlobHeader header {USERDB_BLOB_MAGIC, USERDB_BLOB_VERSION, static_cast<uint32_t>(names.size()),
+            static_cast<uint32_t>(strings)};
+    std::size_t size = userdb_blob_size(header.count, header.stringsSize);
+
+    int fd = memfd_create("userdb-reply", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        std::cerr << "Failed to create reply memfd: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0)
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map reply memfd: " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    // The names are written once, straight into the memory the client maps
+    auto *bytes = static_cast<uint8_t *>(mapping);
+    auto *offsets = reinterpret_cast<uint32_t *>(bytes + sizeof(header));
+    char *area = reinterpret_cast<char *>(bytes + sizeof(header) + names.size() * sizeof(uint32_t));
+    std::memcpy(bytes, &header, sizeof(header));
+
+    uint32_t pos = 0;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        offsets[i] = pos;
+        std::memcpy(area + pos, names[i].c_str(), names[i].size() + 1);
+        pos += static_cast<uint32_t>(names[i].size() + 1);
+    }
+
+    // F_SEAL_WRITE requires the writable mapping to be gone
+    munmap(mapping, size);
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        std::cerr << "Failed to seal reply memfd: " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
@@ -0,0 +1,15 @@
+#ifndef USERDB_NAME_BLOB_H_
+#define USERDB_NAME_BLOB_H_
+
+#include <string>
+#include <vector>
+
+// Name lists larger than USERDB_BLOB_THRESHOLD are passed to clients in a sealed memfd, in the layout of
+// userdb_blob.h, so that they are neither copied through the socket nor parsed again by the client
+
+bool needsNameBlob(const std::vector<std::string> &names);
+
+// Writes the names into a sealed memfd. Returns the fd or -1.
+int writeNameBlob(const std::vector<std::string> &names);
+
+#endif
@@ -0,0 +1,63 @@
+#include "name_index.h"
+
+#include <algorithm>
+
+NameIndex::NameIndex(std::vector<std::string> names)
+{
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    std::size_t total = 0;
+    for (const auto &name : names)
+        total += name.size() + 1;
+
+    m_data.reserve(total);
+    m_offsets.reserve(names.size());
+    for (const auto &name : names) {
+        m_offsets.push_back(m_data.size());
+        m_data.append(name);
+        m_data.push_back('\0');
+    }
+}
+
+std::string_view NameIndex::at(std::size_t i) const
+{
+    return std::string_view(m_data.data() + m_offsets[i]);
+}
+
+std::vector<std::string> NameIndex::search(std::string_view prefix, std::string_view after, std::size_t limit,
+        bool *more) const
+{
+    std::vector<std::string> names;
+    *more = false;
+
+    // First name that is not less than prefix and greater than after
+    std::size_t first;
+    if (after < prefix) {
+        first = std::lower_bound(m_offsets.begin(), m_offsets.end(), prefix,
+                        [this](uint32_t offset, std::string_view key) {
+                            return std::string_view(m_data.data() + offset) < key;
+                        }) -
+                m_offsets.begin();
+    }
+    else {
+        first = std::upper_bound(m_offsets.begin(), m_offsets.end(), after,
+                        [this](std::string_view key, uint32_t offset) {
+                            return key < std::string_view(m_data.data() + offset);
+                        }) -
+                m_offsets.begin();
+    }
+
+    for (std::size_t i = first; i < m_offsets.size(); ++i) {
+        std::string_view name = at(i);
+        if (name.substr(0, prefix.size()) != prefix)
+            break;
+        if (names.size() == limit) {
+            *more = true;
+            break;
+        }
+        names.emplace_back(name);
+    }
+
+    return names;
+}
@@ -0,0 +1,36 @@
+#ifndef USERDB_NAME_INDEX_H_
+#define USERDB_NAME_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Sorted, immutable set of names for prefix search. The names are stored back to back in a single buffer and
+// addressed through an array of offsets, so that the index costs little more than the names themselves and a search
+// is a binary search followed by a scan of the matches.
+class NameIndex
+{
+public:
+    NameIndex() = default;
+    explicit NameIndex(std::vector<std::string> names);
+
+    // Names starting with prefix and greater than after, at most limit of them. Sets *more if further names match.
+    std::vector<std::string> search(std::string_view prefix, std::string_view after, std::size_t limit,
+            bool *more) const;
+
+    std::size_t size() const
+    {
+        return m_offsets.size();
+    }
+
+private:
+    std::string_view at(std::size_t i) const;
+
+    std::string m_data;
+    // Start of each name in m_data; names are NUL-terminated
+    std::vector<uint32_t> m_offsets;
+};
+
+#endif
@@ -0,0 +1,205 @@
+#include "nesting.h"
+
+// Counts the direct users of from as effective users of group
+void GroupNesting::gainUsers(const std::string &group, const Node &from)
+{
+    auto &effective = m_nodes[group].effectiveUsers;
+    for (const auto &user : from.users) {
+        if (effective[user]++ == 0)
+            m_userGroups[user].insert(group);
+    }
+}
+
+void GroupNesting::loseUsers(const std::string &group, const Node &from)
+{
+    auto &effective = m_nodes[group].effectiveUsers;
+    for (const auto &user : from.users) {
+        auto it = effective.find(user);
+        if (it == effective.end() || --it->second > 0)
+            continue;
+
+        effective.erase(it);
+        auto groups = m_userGroups.find(user);
+        groups->second.erase(group);
+        if (groups->second.empty())
+            m_userGroups.erase(groups);
+    }
+}
+
+bool GroupNesting::createsCycle(const std::string &parent, const std::string &child)
+{
+    return parent == child || m_nodes[child].descendants.count(parent);
+}
+
+bool GroupNesting::addNesting(const std::string &parent, const std::string &child)
+{
+    if (createsCycle(parent, child)) {
+        m_pending.emplace(parent, child);
+        return false;
+    }
+
+    insertNesting(parent, child);
+    return true;
+}
+
+// Adds the pending edges that no longer create a cycle. Adding an edge never breaks a cycle, so one pass is enough.
+void GroupNesting::addPending()
+{
+    for (auto it = m_pending.begin(); it != m_pending.end();) {
+        if (createsCycle(it->first, it->second)) {
+            ++it;
+            continue;
+        }
+        insertNesting(it->first, it->second);
+        it = m_pending.erase(it);
+    }
+}
+
+void GroupNesting::insertNesting(const std::string &parent, const std::string &child)
+{
+    Node &parentNode = m_nodes[parent];
+    if (!parentNode.children.insert(child).second)
+        return;
+    m_nodes[child].parents.insert(parent);
+
+    std::vector<std::string> targets(parentNode.ancestors.begin(), parentNode.ancestors.end());
+    targets.push_back(parent);
+    std::vector<std::string> added(m_nodes[child].descendants.begin(), m_nodes[child].descendants.end());
+    added.push_back(child);
+
+    for (const auto &target : targets) {
+        for (const auto &group : added) {
+            if (!m_nodes[target].descendants.insert(group).second)
+                continue;
+            m_nodes[group].ancestors.insert(target);
+            gainUsers(target, m_nodes[group]);
+        }
+    }
+}
+
+// Descendants of a group after an edge removal. Only groups in affected may have lost descendants, the closure of
+// all other groups is still valid.
+const std::set<std::string> &GroupNesting::recomputeDescendants(const std::string &group,
+        const std::set<std::string> &affected, std::unordered_map<std::string, std::set<std::string>> &memo)
+{
+    if (!affected.count(group))
+        return m_nodes[group].descendants;
+
+    auto it = memo.find(group);
+    if (it != memo.end())
+        return it->second;
+
+    std::set<std::string> descendants;
+    for (const auto &child : m_nodes[group].children) {
+        descendants.insert(child);
+        const auto &nested = recomputeDescendants(child, affected, memo);
+        descendants.insert(nested.begin(), nested.end());
+    }
+    return memo[group] = std::move(descendants);
+}
+
+void GroupNesting::removeNesting(const std::string &parent, const std::string &child)
+{
+    if (m_pending.erase({parent, child}))
+        return;
+
+    auto parentIt = m_nodes.find(parent);
+    if (parentIt == m_nodes.end() || !parentIt->second.children.erase(child))
+        return;
+    m_nodes[child].parents.erase(parent);
+
+    std::set<std::string> affected = parentIt->second.ancestors;
+    affected.insert(parent);
+
+    std::unordered_map<std::string, std::set<std::string>> memo;
+    for (const auto &group : affected)
+        recomputeDescendants(group, affected, memo);
+
+    for (auto &[group, descendants] : memo) {
+        Node &node = m_nodes[group];
+        for (const auto &lost : node.descendants) {
+            if (descendants.count(lost))
+                continue;
+            m_nodes[lost].ancestors.erase(group);
+            loseUsers(group, m_nodes[lost]);
+        }
+        node.descendants = std::move(descendants);
+    }
+
+    if (!m_pending.empty())
+        addPending();
+}
+
+void GroupNesting::addUser(const std::string &group, const std::string &user)
+{
+    Node &node = m_nodes[group];
+    if (!node.users.insert(user).second)
+        return;
+
+    Node single;
+    single.users.insert(user);
+    gainUsers(group, single);
+    for (const auto &ancestor : node.ancestors)
+        gainUsers(ancestor, single);
+}
+
+void GroupNesting::removeUser(const std::string &group, const std::string &user)
+{
+    auto it = m_nodes.find(group);
+    if (it == m_nodes.end() || !it->second.users.erase(user))
+        return;
+
+    Node single;
+    single.users.insert(user);
+    loseUsers(group, single);
+    for (const auto &ancestor : it->second.ancestors)
+        loseUsers(ancestor, single);
+}
+
+void GroupNesting::removeGroup(const std::string &group)
+{
+    auto it = m_nodes.find(group);
+    if (it == m_nodes.end())
+        return;
+
+    // Pending edges from the group go with its members, the ones to it are still wanted by their parents
+    for (auto pending = m_pending.begin(); pending != m_pending.end();) {
+        if (pending->first == group)
+            pending = m_pending.erase(pending);
+        else
+            ++pending;
+    }
+
+    // Copies: the sets shrink while the edges are removed
+    std::set<std::string> children = it->second.children;
+    std::set<std::string> users = it->second.users;
+    for (const auto &child : children)
+        removeNesting(group, child);
+    for (const auto &user : users)
+        removeUser(group, user);
+
+    // Still referenced by the groups it is nested in
+    if (m_nodes[group].parents.empty())
+        m_nodes.erase(group);
+}
+
+std::vector<std::string> GroupNesting::effectiveMembers(const std::string &group) const
+{
+    std::vector<std::string> members;
+    auto it = m_nodes.find(group);
+    if (it == m_nodes.end())
+        return members;
+
+    members.reserve(it->second.effectiveUsers.size());
+    for (const auto &entry : it->second.effectiveUsers)
+        members.push_back(entry.first);
+    return members;
+}
+
+std::vector<std::string> GroupNesting::groupsOf(const std::string &user) const
+{
+    auto it = m_userGroups.find(user);
+    if (it == m_userGroups.end())
+        return {};
+    return std::vector<std::string>(it->second.begin(), it->second.end());
+}
@@ -0,0 +1,67 @@
+#ifndef USERDB_NESTING_H_
+#define USERDB_NESTING_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Groups nested in other groups, with the transitive closure kept up to date on every change.
+//
+// For each group the index holds all groups nested in it at any depth and the effective user members, counted by
+// the number of groups in the nesting that list the user directly. Lookups of effective members and of the groups
+// a user belongs to are answered from these sets without walking the nesting. Adding or removing an edge or a user
+// touches only the groups that contain the changed group, so an update costs O(ancestors * descendants) at most.
+//
+// Edges that would create a cycle are kept pending and added as soon as a removal makes them acyclic, so that the
+// index does not depend on the order in which the edges of a consistent configuration are applied.
+class GroupNesting
+{
+public:
+    // Nests child in parent. Returns false if the edge would create a cycle, in which case it is kept pending.
+    bool addNesting(const std::string &parent, const std::string &child);
+    // Removes the edge, or forgets it if it is pending
+    void removeNesting(const std::string &parent, const std::string &child);
+
+    void addUser(const std::string &group, const std::string &user);
+    void removeUser(const std::string &group, const std::string &user);
+
+    // Removes the groups nested in the group and its direct members. The groups the group is nested in keep their
+    // edge to it, so that the group is nested again once it is re-added.
+    void removeGroup(const std::string &group);
+
+    // Users of the group and of all groups nested in it, sorted
+    std::vector<std::string> effectiveMembers(const std::string &group) const;
+    // Groups the user belongs to directly or through nesting
+    std::vector<std::string> groupsOf(const std::string &user) const;
+
+private:
+    struct Node
+    {
+        std::set<std::string> children;
+        std::set<std::string> parents;
+        std::set<std::string> users;
+        // Transitive closure in both directions, the group itself excluded
+        std::set<std::string> descendants;
+        std::set<std::string> ancestors;
+        // Effective users, with the number of groups in {group} + descendants listing each one directly
+        std::map<std::string, unsigned> effectiveUsers;
+    };
+
+    bool createsCycle(const std::string &parent, const std::string &child);
+    void insertNesting(const std::string &parent, const std::string &child);
+    void addPending();
+    void gainUsers(const std::string &group, const Node &from);
+    void loseUsers(const std::string &group, const Node &from);
+    const std::set<std::string> &recomputeDescendants(const std::string &group,
+            const std::set<std::string> &affected, std::unordered_map<std::string, std::set<std::string>> &memo);
+
+    std::unordered_map<std::string, Node> m_nodes;
+    std::unordered_map<std::string, std::set<std::string>> m_userGroups;
+    // Edges rejected as cycles, as (parent, child)
+    std::set<std::pair<std::string, std::string>> m_pending;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "nesting.h"
+
+static int failures = 0;
+
+static std::string join(const std::vector<std::string> &names)
+{
+    std::string joined;
+    for (const auto &name : names)
+        joined += (joined.empty() ? "" : ",") + name;
+    return joined;
+}
+
+static void expect(const char *what, const std::vector<std::string> &actual, const std::string &expected)
+{
+    if (join(actual) == expected)
+        return;
+    std::cerr << "FAIL " << what << ": got \"" << join(actual) << "\", expected \"" << expected << "\"" << std::endl;
+    ++failures;
+}
+
+static void expectTrue(const char *what, bool value)
+{
+    if (value)
+        return;
+    std::cerr << "FAIL " << what << std::endl;
+    ++failures;
+}
+
+static void testAddRemove()
+{
+    GroupNesting nesting;
+    nesting.addUser("staff", "alice");
+    nesting.addUser("admins", "bob");
+    expectTrue("add edge", nesting.addNesting("staff", "admins"));
+    expect("members after add", nesting.effectiveMembers("staff"), "alice,bob");
+    expect("groups after add", nesting.groupsOf("bob"), "admins,staff");
+
+    nesting.removeNesting("staff", "admins");
+    expect("members after remove", nesting.effectiveMembers("staff"), "alice");
+    expect("groups after remove", nesting.groupsOf("bob"), "admins");
+
+    nesting.removeUser("admins", "bob");
+    expect("groups after user removal", nesting.groupsOf("bob"), "");
+}
+
+// A removed group keeps its place in the groups it is nested in, and is seen there again once re-added
+static void testReAdd()
+{
+    GroupNesting nesting;
+    nesting.addNesting("all", "staff");
+    nesting.addNesting("staff", "admins");
+    nesting.addUser("staff", "alice");
+    nesting.addUser("admins", "bob");
+
+    nesting.removeGroup("staff");
+    expect("members of parent after group removal", nesting.effectiveMembers("all"), "");
+    expect("members of removed group", nesting.effectiveMembers("staff"), "");
+    expect("groups of nested user after group removal", nesting.groupsOf("bob"), "admins");
+
+    nesting.addUser("staff", "carol");
+    nesting.addNesting("staff", "admins");
+    expect("members of parent after re-add", nesting.effectiveMembers("all"), "bob,carol");
+    expect("groups after re-add", nesting.groupsOf("bob"), "admins,all,staff");
+}
+
+// A user reachable along two paths stays a member until both are gone
+static void testDiamond()
+{
+    GroupNesting nesting;
+    nesting.addNesting("top", "left");
+    nesting.addNesting("top", "right");
+    nesting.addNesting("left", "bottom");
+    nesting.addNesting("right", "bottom");
+    nesting.addUser("bottom", "alice");
+    expect("diamond members", nesting.effectiveMembers("top"), "alice");
+    expect("diamond groups", nesting.groupsOf("alice"), "bottom,left,right,top");
+
+    nesting.removeNesting("left", "bottom");
+    expect("diamond members after one path removed", nesting.effectiveMembers("top"), "alice");
+    expect("diamond groups after one path removed", nesting.groupsOf("alice"), "bottom,right,top");
+
+    nesting.removeNesting("right", "bottom");
+    expect("diamond members after both paths removed", nesting.effectiveMembers("top"), "");
+    expect("diamond groups after both paths removed", nesting.groupsOf("alice"), "bottom");
+}
+
+// An edge closing a cycle is held back until the edge it conflicts with is removed
+static void testCycle()
+{
+    GroupNesting nesting;
+    nesting.addUser("a", "alice");
+    nesting.addUser("c", "carol");
+    nesting.addNesting("a", "b");
+    nesting.addNesting("b", "c");
+    expectTrue("self nesting rejected", !nesting.addNesting("a", "a"));
+    expectTrue("cycle rejected", !nesting.addNesting("c", "a"));
+    expect("members with cycle pending", nesting.effectiveMembers("c"), "carol");
+
+    nesting.removeNesting("a", "b");
+    expect("pending edge added after removal", nesting.effectiveMembers("c"), "alice,carol");
+    expect("groups after pending edge added", nesting.groupsOf("alice"), "a,b,c");
+
+    // A pending edge that was removed is not added later
+    expectTrue("second cycle rejected", !nesting.addNesting("a", "c"));
+    nesting.removeNesting("a", "c");
+    nesting.removeNesting("c", "a");
+    nesting.addNesting("a", "c");
+    expect("members after pending edge forgotten", nesting.effectiveMembers("a"), "alice,carol");
+    expect("members of former cycle", nesting.effectiveMembers("c"), "carol");
+}
+
+int main()
+{
+    testAddRemove();
+    testReAdd();
+    testDiamond();
+    testCycle();
+
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}